@@ -12,9 +12,16 @@
 #include <linux/cdev.h>
 
 #include <asm/uaccess.h>    /* copy_*_user */
+#include <linux/ktime.h>
 
 #include "scull.h"        /* local definitions */
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
+
+MODULE_LICENSE("GPL");   /* tracepoints are ignored in proprietary modules */
+
 
 int scull_major = SCULL_MAJOR;
 int scull_minor = 0;
@@ -29,7 +36,23 @@ module_param(scull_qset, int, S_IRUGO);
 
 
 
-
+/*
+ * down_interruptible() that reports how long it waited when the
+ * scull_lock_wait tracepoint is on, and costs nothing extra otherwise.
+ */
+static int
+scull_down_interruptible(struct semaphore *sem)
+{
+    u64 start;
+    int ret;
+
+    if (!trace_scull_lock_wait_enabled())
+        return down_interruptible(sem);
+    start = ktime_get_ns();
+    ret = down_interruptible(sem);
+    trace_scull_lock_wait(sem, _RET_IP_, ktime_get_ns() - start, ret);
+    return ret;
+}
 
 
 int
@@ -63,6 +86,7 @@ struct scull_qset
 {
     struct scull_qset *qs = dev->data;
     
+    trace_scull_follow(MINOR(dev->cdev.dev), n);
 
     if (!qs) {
         qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
@@ -72,6 +96,8 @@ struct scull_qset
             return NULL;
         }
         memset(qs, 0, sizeof(struct scull_qset));
+        trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_QSET,
+                          sizeof(struct scull_qset), qs);
     }
     
 
@@ -83,6 +109,8 @@ struct scull_qset
                 return NULL;
             }
             memset(qs->next, 0, sizeof(struct scull_qset));
+            trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_QSET,
+                              sizeof(struct scull_qset), qs->next);
         }
         qs = qs->next;
     }
@@ -101,8 +129,11 @@ scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
     int item, rest, s_pos, q_pos;
     ssize_t retval = 0;
     
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    trace_scull_read_enter(MINOR(dev->cdev.dev), *f_pos, count);
+    if (scull_down_interruptible(&dev->sem)) {
+        retval = -ERESTARTSYS;
+        goto out_unlocked;
+    }
     if (*f_pos >= dev->size)
         goto out;
     if (*f_pos + count > dev->size)
@@ -131,6 +162,8 @@ scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
     
 out:
     up(&dev->sem);
+out_unlocked:
+    trace_scull_read_exit(MINOR(dev->cdev.dev), retval);
     return retval;
 }
 
@@ -144,8 +177,11 @@ scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_p
     int item, s_pos, q_pos, rest;
     ssize_t retval = -ENOMEM;    
     
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    trace_scull_write_enter(MINOR(dev->cdev.dev), *f_pos, count);
+    if (scull_down_interruptible(&dev->sem)) {
+        retval = -ERESTARTSYS;
+        goto out_unlocked;
+    }
     
 
     item = (long)*f_pos / itemsize;    
@@ -165,6 +201,8 @@ scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_p
             goto out;
         }
         memset(dptr->data, 0, qset * sizeof(char *));
+        trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_PTRS,
+                          qset * sizeof(char *), dptr->data);
     }
     if (!dptr->data[s_pos]) {
         dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
@@ -172,6 +210,8 @@ scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_p
             PDEBUG("km_dptr->data[s_pos]_fail\n");
             goto out;
         }
+        trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_QUANTUM,
+                          quantum, dptr->data[s_pos]);
     }
     
 
@@ -185,7 +225,7 @@ scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_p
     }
     *f_pos += count;
     retval = count;
-    PDEBUG("%d", count);
+    PDEBUGG("%d", count);
     
 
     if (dev->size < *f_pos)
@@ -193,6 +233,8 @@ scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_p
 
 out:    
     up(&dev->sem);
+out_unlocked:
+    trace_scull_write_exit(MINOR(dev->cdev.dev), retval);
     return retval;
 }
 
@@ -231,7 +273,7 @@ scull_open(struct inode *inode, struct file *filp)
     
 
     if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (down_interruptible(&dev->sem))
+        if (scull_down_interruptible(&dev->sem))
             return -ERESTARTSYS;
         scull_trim(dev);    
         up(&dev->sem);
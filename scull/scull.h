@@ -13,8 +13,6 @@
 #define SCULL_QSET 1000
 #endif /* SCULL_QSET */
 
-#define SCULL_DEBUG   
-
 #undef PDEBUG
 #ifdef SCULL_DEBUG
 #ifdef __KERNEL__
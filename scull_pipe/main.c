@@ -5,14 +5,23 @@
 #include <linux/kdev_t.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 #include <asm/uaccess.h>
 
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 
 #include <linux/capability.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/nodemask.h>
+#include <linux/overflow.h>
+#include <linux/topology.h>
 #include "scull.h"
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 
 
 MODULE_LICENSE("GPL");
@@ -22,8 +31,14 @@ int scull_minor=0;
 int scull_nr_devs = SCULL_NR_DEVS; // number of bare scull devices
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset = SCULL_QSET;
+int scull_numa_policy = SCULL_NUMA_DEFAULT;
+int scull_numa_node = NUMA_NO_NODE;     /* for SCULL_NUMA_BIND */
+
+module_param(scull_numa_policy, int, S_IRUGO);
+module_param(scull_numa_node, int, S_IRUGO);
 
 struct scull_dev *scull_devices;    /* allocated in scull_init_module */
+static bool scull_backing_bad;      /* do not save over an image we failed to load */
 
 
 #ifdef SCULL_DEBUG 
@@ -92,12 +107,11 @@ static int scull_proc_open(struct inode *inode, struct file *file)
 /*
  * Create a set of file operations for our proc file.
  */
-static struct file_operations scull_proc_ops = {
-    .owner     = THIS_MODULE,
-    .open      = scull_proc_open,
-    .read      = seq_read,
-    .llseek    = seq_lseek,
-    .release   = seq_release
+static const struct proc_ops scull_proc_ops = {
+    .proc_open    = scull_proc_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = seq_release
 };
 
 
@@ -118,6 +132,205 @@ static void scull_remove_proc(void)
 #endif /*SCULL_DEBUG*/
 
 
+/*
+ * mutex_lock_interruptible() that reports how long it waited when the
+ * scull_lock_wait tracepoint is on, and costs nothing extra otherwise.
+ */
+int scull_lock_interruptible(struct mutex *lock)
+{
+    u64 start;
+    int ret;
+
+    if (!trace_scull_lock_wait_enabled())
+        return mutex_lock_interruptible(lock);
+    start = ktime_get_ns();
+    ret = mutex_lock_interruptible(lock);
+    trace_scull_lock_wait(lock, _RET_IP_, ktime_get_ns() - start, ret);
+    return ret;
+}
+
+
+/*
+ * Allocate one quantum on the node chosen by the device NUMA policy.
+ * Called with the device mutex held.
+ */
+void *scull_alloc_quantum(struct scull_dev *dev)
+{
+    int node;
+
+    switch (dev->numa_policy) {
+        case SCULL_NUMA_LOCAL:
+            node = numa_node_id();
+            break;
+        case SCULL_NUMA_INTERLEAVE:
+            node = dev->numa_next;
+            dev->numa_next = next_node_in(node, node_states[N_MEMORY]);
+            break;
+        case SCULL_NUMA_BIND:
+            node = dev->numa_node;
+            break;
+        default:
+            return kmalloc(dev->quantum, GFP_KERNEL);
+    }
+    return kmalloc_node(dev->quantum, GFP_KERNEL, node);
+}
+
+/* Validate a policy, as given to SCULL_IOCSNUMA or at load time */
+static int scull_check_numa(struct scull_numa *numa)
+{
+    switch (numa->policy) {
+        case SCULL_NUMA_BIND:
+            if (numa->node < 0 || numa->node >= nr_node_ids ||
+                !node_state(numa->node, N_MEMORY))
+                return -EINVAL;
+            break;
+        case SCULL_NUMA_DEFAULT:
+        case SCULL_NUMA_LOCAL:
+        case SCULL_NUMA_INTERLEAVE:
+            numa->node = NUMA_NO_NODE;
+            break;
+        default:
+            return -EINVAL;
+    }
+    return 0;
+}
+
+static int scull_set_numa(struct scull_dev *dev, struct scull_numa *numa)
+{
+    int err = scull_check_numa(numa);
+
+    if (err)
+        return err;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    dev->numa_policy = numa->policy;
+    dev->numa_node = numa->node;
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+/*
+ * /proc/scullnuma: the policy of each device and where its quanta
+ * actually landed. Unlike scullseq it is always built, the breakdown
+ * is what tells whether a policy is doing its job.
+ */
+static int scull_numa_show(struct seq_file *s, void *v)
+{
+    struct scull_dev *dev;
+    struct scull_qset *d;
+    unsigned long *resident;
+    int i, nid;
+
+    resident = kcalloc(nr_node_ids, sizeof(*resident), GFP_KERNEL);
+    if (!resident)
+        return -ENOMEM;
+    for (dev = scull_devices; dev < scull_devices + scull_nr_devs; dev++) {
+        if (mutex_lock_interruptible(&dev->mutex)) {
+            kfree(resident);
+            return -ERESTARTSYS;
+        }
+        memset(resident, 0, nr_node_ids * sizeof(*resident));
+        for (d = dev->data; d; d = d->next) {
+            if (!d->data)
+                continue;
+            for (i = 0; i < dev->qset; i++)
+                if (d->data[i])
+                    resident[page_to_nid(virt_to_page(d->data[i]))] += dev->quantum;
+        }
+        seq_printf(s, "Device %i: policy %i node %i\n", (int)(dev - scull_devices),
+                   dev->numa_policy, dev->numa_node);
+        mutex_unlock(&dev->mutex);
+        for_each_node(nid)
+            if (resident[nid])
+                seq_printf(s, " node %i: %lu bytes\n", nid, resident[nid]);
+    }
+    kfree(resident);
+    return 0;
+}
+
+static int scull_numa_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, scull_numa_show, NULL);
+}
+
+static const struct proc_ops scull_numa_proc_ops = {
+    .proc_open    = scull_numa_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = single_release
+};
+
+/*
+ * Fill the user's extent array from the qset population, merging
+ * neighbouring quanta. Holes are never allocated here.
+ */
+static long scull_extent_map(struct scull_dev *dev, struct scull_extent_map __user *umap)
+{
+    struct scull_extent_map map;
+    struct scull_extent ext = { 0, 0 };
+    struct scull_qset *dptr;
+    loff_t index, off, end;
+    int i, retval = 0;
+
+    if (copy_from_user(&map, umap, sizeof(map)))
+        return -EFAULT;
+    map.mapped = 0;
+    map.flags = 0;
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    index = 0;
+    for (dptr = dev->data; dptr; dptr = dptr->next, index += dev->qset) {
+        if (!dptr->data)
+            continue;
+        for (i = 0; i < dev->qset; i++) {
+            if (!dptr->data[i])
+                continue;
+            off = (index + i) * dev->quantum;
+            end = min_t(loff_t, off + dev->quantum, dev->size);
+            if (end <= map.start)
+                continue;
+            off = max_t(loff_t, off, map.start);
+            /* a failed write can leave a quantum past dev->size */
+            if (end <= off)
+                continue;
+            if (ext.length && ext.offset + ext.length == off) {
+                ext.length += end - off;
+                continue;
+            }
+            if (ext.length) {
+                if (map.mapped == map.nr_extents)
+                    goto done;
+                if (copy_to_user(&umap->extents[map.mapped], &ext, sizeof(ext))) {
+                    retval = -EFAULT;
+                    goto out;
+                }
+                map.mapped++;
+            }
+            ext.offset = off;
+            ext.length = end - off;
+        }
+    }
+    if (ext.length) {
+        if (map.mapped == map.nr_extents)
+            goto done;
+        if (copy_to_user(&umap->extents[map.mapped], &ext, sizeof(ext))) {
+            retval = -EFAULT;
+            goto out;
+        }
+        map.mapped++;
+    }
+    map.flags |= SCULL_EXTMAP_LAST;
+
+done:
+    if (copy_to_user(umap, &map, sizeof(map)))
+        retval = -EFAULT;
+out:
+    mutex_unlock(&dev->mutex);
+    return retval;
+}
+
+
 int scull_trim(struct scull_dev *dev)
 {
     struct scull_qset *next, *dptr;
@@ -150,7 +363,10 @@ int scull_open(struct inode *inode, struct file *filp)
 
 
     if((filp->f_flags & O_ACCMODE) == O_WRONLY){
+        if (mutex_lock_interruptible(&dev->mutex))
+            return -ERESTARTSYS;
         scull_trim(dev);   
+        mutex_unlock(&dev->mutex);
     }
     return 0;
 }
@@ -167,12 +383,16 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 {
     struct scull_qset *qs = dev->data;
 
+    trace_scull_follow(MINOR(dev->cdev.dev), n);
+
     /* Allocate first qset explicitly if need be */
     if(!qs) {
         qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
         if (qs == NULL)
             return NULL;    
         memset(qs, 0, sizeof(struct scull_qset));
+        trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_QSET,
+                          sizeof(struct scull_qset), qs);
     }
 
     /* Then follow the list */
@@ -182,6 +402,8 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
             if (qs->next == NULL)
                 return NULL;    
             memset(qs->next, 0, sizeof(struct scull_qset));
+            trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_QSET,
+                              sizeof(struct scull_qset), qs->next);
         }
         qs = qs->next;
         continue;
@@ -189,29 +411,74 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
     return qs;
 }
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Like scull_follow(), but never allocates: reads must not grow the
+ * list when they land in a hole.
+ */
+struct scull_qset *scull_lookup(struct scull_dev *dev, int n)
 {
-    struct scull_dev *dev = filp->private_data;
+    struct scull_qset *qs = dev->data;
+
+    trace_scull_follow(MINOR(dev->cdev.dev), n);
+    while (qs && n--)
+        qs = qs->next;
+    return qs;
+}
+
+/*
+ * Split a file position into list item, quantum and offset. The
+ * item size is computed in 64 bits so that large quantum/qset
+ * settings cannot overflow it, and positions whose item does not fit
+ * scull_follow() are refused.
+ */
+int scull_locate(struct scull_dev *dev, loff_t pos, int *item, int *s_pos, int *q_pos)
+{
+    u64 itemsize = (u64)dev->quantum * dev->qset;
+    u64 nitem, rest;
+    u32 off;
+
+    if (pos < 0)
+        return -EFBIG;
+    nitem = div64_u64_rem(pos, itemsize, &rest);
+    if (nitem > INT_MAX)
+        return -EFBIG;
+    *item = nitem;
+    *s_pos = div_u64_rem(rest, dev->quantum, &off);
+    *q_pos = off;
+    return 0;
+}
+
+/*
+ * Read and write go through an iov_iter, which is a user buffer for
+ * read(2) and write(2) and a kernel one for the KUnit suite.
+ */
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
     struct scull_qset *dptr;    
-    int quantum = dev->quantum, qset = dev->qset;
-    int itemsize = quantum * qset; 
-    int item, s_pos, q_pos, rest;   
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t done;
+    int quantum;
+    int item, s_pos, q_pos;   
     ssize_t retval = 0;
 
-    if(mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-    if(*f_pos >= dev->size)
+    trace_scull_read_enter(MINOR(dev->cdev.dev), *f_pos, count);
+    if(scull_lock_interruptible(&dev->mutex)) {
+        retval = -ERESTARTSYS;
+        goto out_unlocked;
+    }
+    if(*f_pos < 0 || *f_pos >= dev->size)
         goto out;
-    if(*f_pos + count > dev->size)
+    if(count > dev->size - *f_pos)
         count = dev->size - *f_pos;
 
-    
-    item = (long) *f_pos / itemsize;
-    rest = (long) *f_pos % itemsize;
-    s_pos = rest / quantum; q_pos = rest % quantum;
+    quantum = dev->quantum;
+    if (scull_locate(dev, *f_pos, &item, &s_pos, &q_pos))
+        goto out;
 
    
-    dptr = scull_follow(dev, item);
+    dptr = scull_lookup(dev, item);
 
     if(dptr == NULL || !dptr->data || !dptr->data[s_pos])
         goto out;   
@@ -220,34 +487,45 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_
     if (count > quantum - q_pos)
         count = quantum - q_pos;
 
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+    done = copy_to_iter(dptr->data[s_pos] + q_pos, count, to);
+    if (!done && count) {
         retval = -EFAULT;
         goto out;
     }
-    *f_pos += count;
-    retval = count;
+    *f_pos += done;
+    retval = done;
 
 out:
     mutex_unlock(&dev->mutex);
+out_unlocked:
+    trace_scull_read_exit(MINOR(dev->cdev.dev), retval);
     return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct scull_dev *dev = filp->private_data;
+    struct scull_dev *dev = iocb->ki_filp->private_data;
     struct scull_qset *dptr;
-    int quantum = dev->quantum, qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    size_t done;
+    int quantum, qset;
+    int item, s_pos, q_pos;
     ssize_t retval = -ENOMEM;   
 
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
+    trace_scull_write_enter(MINOR(dev->cdev.dev), *f_pos, count);
+    if (scull_lock_interruptible(&dev->mutex)) {
+        retval = -ERESTARTSYS;
+        goto out_unlocked;
+    }
 
-   
-    item = (long) *f_pos / itemsize;
-    rest = (long) *f_pos % itemsize;
-    s_pos = rest / quantum; q_pos = rest % quantum;
+    /* the geometry may have changed while we waited for the mutex */
+    quantum = dev->quantum;
+    qset = dev->qset;
+    retval = scull_locate(dev, *f_pos, &item, &s_pos, &q_pos);
+    if (retval)
+        goto out;
+    retval = -ENOMEM;
 
    
     dptr = scull_follow(dev, item);
@@ -258,22 +536,27 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, lof
         if (!dptr->data)
             goto out;
         memset(dptr->data, 0, qset * sizeof(char *));
+        trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_PTRS,
+                          qset * sizeof(char *), dptr->data);
     }
     if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
+        dptr->data[s_pos] = scull_alloc_quantum(dev);
         if (!dptr->data[s_pos])
             goto out;
+        trace_scull_alloc(MINOR(dev->cdev.dev), SCULL_ALLOC_QUANTUM,
+                          quantum, dptr->data[s_pos]);
     }
    
     if (count > quantum - q_pos)
         count = quantum - q_pos;
 
-    if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
+    done = copy_from_iter(dptr->data[s_pos] + q_pos, count, from);
+    if (!done && count) {
         retval = -EFAULT;
         goto out;
     }
-    *f_pos += count;
-    retval = count;
+    *f_pos += done;
+    retval = done;
 
     
     if (dev->size < *f_pos)
@@ -281,12 +564,44 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, lof
 
 out:
     mutex_unlock(&dev->mutex);
+out_unlocked:
+    trace_scull_write_exit(MINOR(dev->cdev.dev), retval);
     return retval;
 }
 
+/*
+ * SEEK_END is relative to dev->size. Positions past it are fine (the
+ * next write leaves a hole); positions an loff_t cannot hold are not.
+ */
+loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct scull_dev *dev = filp->private_data;
+    loff_t base, newpos;
+
+    switch(whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = filp->f_pos;
+            break;
+        case SEEK_END:
+            base = dev->size;
+            break;
+        default:
+            return -EINVAL;
+    }
+    if (check_add_overflow(base, off, &newpos) || newpos < 0)
+        return -EINVAL;
+    filp->f_pos = newpos;
+    return newpos;
+}
+
 
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    struct scull_dev *dev = filp->private_data;
+    struct scull_numa numa;
     int err = 0, tmp;
     int retval = 0;
 
@@ -295,10 +610,8 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
 
     
-    if (_IOC_DIR(cmd) & _IOC_READ)
-        err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-    else if (_IOC_DIR(cmd) & _IOC_WRITE)
-        err = !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+    if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE))
+        err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
     if (err) return -EFAULT;
 
     switch(cmd){
@@ -378,6 +691,24 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             return tmp;
 
 
+        case SCULL_IOCSNUMA:
+            if (! capable (CAP_SYS_ADMIN))
+                return -EPERM;
+            if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+                return -EFAULT;
+            retval = scull_set_numa(dev, &numa);
+            break;
+
+        case SCULL_IOCGNUMA:
+            numa.policy = dev->numa_policy;
+            numa.node = dev->numa_node;
+            if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+                return -EFAULT;
+            break;
+
+        case SCULL_IOCEXTMAP:
+            return scull_extent_map(dev, (struct scull_extent_map __user *)arg);
+
         default: 
             return -ENOTTY;
 
@@ -387,8 +718,9 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 struct file_operations scull_fops = {
     .owner = THIS_MODULE,
-    .read = scull_read,
-    .write = scull_write,
+    .llseek = scull_llseek,
+    .read_iter = scull_read_iter,
+    .write_iter = scull_write_iter,
     .unlocked_ioctl = scull_ioctl,
     .open = scull_open,
     .release = scull_release,
@@ -397,11 +729,20 @@ struct file_operations scull_fops = {
 
 void scull_cleanup_module(void)
 {
-    int i;
+    int i, err;
     dev_t devno = MKDEV(scull_major, scull_minor);
 
     
     if (scull_devices){
+        if (scull_backing && scull_backing_bad) {
+            printk(KERN_WARNING "scull: not saving over %s, it did not restore\n",
+                   scull_backing);
+        } else if (scull_backing) {
+            err = scull_save(scull_backing, scull_devices, scull_nr_devs);
+            if (err)
+                printk(KERN_WARNING "scull: saving to %s failed, error %d\n",
+                       scull_backing, err);
+        }
         for(i = 0; i < scull_nr_devs; i++) {
             scull_trim(scull_devices + i);
             cdev_del(&scull_devices[i].cdev);
@@ -409,6 +750,8 @@ void scull_cleanup_module(void)
         kfree(scull_devices);
     }
 
+    /* no problem if it was not registered */
+    remove_proc_entry("scullnuma", NULL);
 #ifdef SCULL_DEBUG 
     scull_remove_proc();
 #endif
@@ -439,6 +782,7 @@ static void scull_setup_cdev(struct scull_dev *dev, int index)
 
 static int scull_init(void)
 {
+    struct scull_numa numa;
     int result, i;
     dev_t dev = 0;
 
@@ -466,19 +810,43 @@ static int scull_init(void)
     }
     memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
+    numa.policy = scull_numa_policy;
+    numa.node = scull_numa_node;
+    if (scull_check_numa(&numa)) {
+        printk(KERN_WARNING "scull: bad NUMA policy %i node %i, using the default\n",
+               scull_numa_policy, scull_numa_node);
+        numa.policy = SCULL_NUMA_DEFAULT;
+        numa.node = NUMA_NO_NODE;
+    }
+
     /* Initialize each device. */
     for (i=0; i<scull_nr_devs; i++){
         scull_devices[i].quantum = scull_quantum;
         scull_devices[i].qset = scull_qset;
+        scull_devices[i].numa_policy = numa.policy;
+        scull_devices[i].numa_node = numa.node;
+        scull_devices[i].numa_next = first_memory_node;
         mutex_init(&scull_devices[i].mutex);
         scull_setup_cdev(&scull_devices[i], i);
     }
 
+    /* Bring back what the previous instance saved, if anything */
+    if (scull_backing) {
+        result = scull_restore(scull_backing, scull_devices, scull_nr_devs);
+        if (result && result != -ENOENT) {
+            printk(KERN_WARNING "scull: restoring from %s failed, error %d\n",
+                   scull_backing, result);
+            scull_backing_bad = true;
+        }
+    }
+
   
     dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
     dev += scull_p_init(dev);
 
 
+    if (!proc_create("scullnuma", 0, NULL, &scull_numa_proc_ops))
+        printk(KERN_WARNING "proc_create scullnuma failed\n");
 #ifdef SCULL_DEBUG 
     scull_create_proc();
 #endif
@@ -490,6 +858,17 @@ fail:
     return result;
 }
 
+#ifdef SCULL_KUNIT
+/* for scull_kunit.ko */
+EXPORT_SYMBOL_GPL(scull_trim);
+EXPORT_SYMBOL_GPL(scull_follow);
+EXPORT_SYMBOL_GPL(scull_lookup);
+EXPORT_SYMBOL_GPL(scull_locate);
+EXPORT_SYMBOL_GPL(scull_read_iter);
+EXPORT_SYMBOL_GPL(scull_write_iter);
+EXPORT_SYMBOL_GPL(scull_llseek);
+#endif
+
 module_init(scull_init);
 module_exit(scull_cleanup_module);
 
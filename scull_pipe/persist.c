@@ -0,0 +1,354 @@
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* filp_open(), kernel_read/write() */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>	/* div_u64_rem() */
+#include <linux/namei.h>	/* lock_rename(), lookup_one_len() */
+#include <linux/string.h>	/* kbasename() */
+#include <linux/version.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Save/restore of the scull devices to a backing file.
+ *
+ * The image is sparse: only populated quanta are stored, each one
+ * preceded by its quantum index, so both saving and restoring cost
+ * time proportional to the data actually present. Everything goes
+ * through a staging buffer to keep the file I/O large and sequential.
+ * The image is meant for a warm restart on the same host, so fields
+ * are stored in native byte order. A save goes to "<path>.tmp" first
+ * and only replaces the image once it is complete and synced, so a
+ * failed save never costs the previous one.
+ */
+
+#define SCULL_IMAGE_MAGIC   0x5343554cU   /* "SCUL" */
+#define SCULL_IMAGE_VERSION 1
+#define SCULL_IMAGE_CHUNK   (64 * 1024)
+
+struct scull_image_hdr {
+    u32 magic;
+    u32 version;
+    u32 nr_devs;
+    u32 pad;
+};
+
+struct scull_image_dev {
+    u32 quantum;
+    u32 qset;
+    u64 size;           /* dev->size at save time */
+    u64 nr_quanta;      /* populated quanta that follow */
+};
+
+struct scull_image_quantum {
+    u64 index;          /* quantum number from the start of the device */
+    u32 len;            /* bytes stored, less than quantum only at the tail */
+    u32 pad;
+};
+
+struct scull_image {
+    struct file *filp;
+    loff_t pos;
+    char *buf;
+    size_t len;         /* bytes staged (save) or available (restore) */
+    size_t off;         /* consume offset into buf (restore) */
+};
+
+char *scull_backing = NULL;   /* backing file, none by default */
+module_param(scull_backing, charp, S_IRUGO);
+
+
+static int scull_image_flush(struct scull_image *img)
+{
+    ssize_t ret;
+    size_t done = 0;
+
+    while (done < img->len) {
+        ret = kernel_write(img->filp, img->buf + done, img->len - done, &img->pos);
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            return -EIO;
+        done += ret;
+    }
+    img->len = 0;
+    return 0;
+}
+
+static int scull_image_put(struct scull_image *img, const void *src, size_t count)
+{
+    size_t n;
+    int err;
+
+    while (count) {
+        if (img->len == SCULL_IMAGE_CHUNK) {
+            err = scull_image_flush(img);
+            if (err)
+                return err;
+        }
+        n = min(count, (size_t)(SCULL_IMAGE_CHUNK - img->len));
+        memcpy(img->buf + img->len, src, n);
+        img->len += n;
+        src += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int scull_image_get(struct scull_image *img, void *dst, size_t count)
+{
+    ssize_t ret;
+    size_t n;
+
+    while (count) {
+        if (img->off == img->len) {
+            ret = kernel_read(img->filp, img->buf, SCULL_IMAGE_CHUNK, &img->pos);
+            if (ret < 0)
+                return ret;
+            if (ret == 0)
+                return -EINVAL;     /* truncated image */
+            img->len = ret;
+            img->off = 0;
+        }
+        n = min(count, img->len - img->off);
+        memcpy(dst, img->buf + img->off, n);
+        img->off += n;
+        dst += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+static int scull_save_dev(struct scull_image *img, struct scull_dev *dev)
+{
+    struct scull_image_dev dhdr;
+    struct scull_image_quantum qhdr;
+    struct scull_qset *dptr;
+    u64 index, nr_quanta = 0;
+    loff_t off;
+    int i, err;
+
+    for (dptr = dev->data; dptr; dptr = dptr->next) {
+        if (!dptr->data)
+            continue;
+        for (i = 0; i < dev->qset; i++)
+            if (dptr->data[i])
+                nr_quanta++;
+    }
+
+    dhdr.quantum = dev->quantum;
+    dhdr.qset = dev->qset;
+    dhdr.size = dev->size;
+    dhdr.nr_quanta = nr_quanta;
+    err = scull_image_put(img, &dhdr, sizeof(dhdr));
+    if (err)
+        return err;
+
+    index = 0;
+    for (dptr = dev->data; dptr; dptr = dptr->next, index += dev->qset) {
+        if (!dptr->data)
+            continue;
+        for (i = 0; i < dev->qset; i++) {
+            if (!dptr->data[i])
+                continue;
+            off = (loff_t)(index + i) * dev->quantum;
+            qhdr.index = index + i;
+            qhdr.len = dev->quantum;
+            if (off >= dev->size)
+                qhdr.len = 0;
+            else if (dev->size - off < dev->quantum)
+                qhdr.len = dev->size - off;
+            qhdr.pad = 0;
+            err = scull_image_put(img, &qhdr, sizeof(qhdr));
+            if (!err)
+                err = scull_image_put(img, dptr->data[i], qhdr.len);
+            if (err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Rebuild the qset list of one device. Quanta come in ascending
+ * order, so the list is grown from its tail instead of being walked
+ * from the head for every record as scull_follow() would.
+ */
+static int scull_restore_dev(struct scull_image *img, struct scull_dev *dev)
+{
+    struct scull_image_dev dhdr;
+    struct scull_image_quantum qhdr;
+    struct scull_qset *dptr = NULL;
+    u64 item, cur = 0, next_index = 0, n;
+    u32 s_pos;
+    int err;
+
+    err = scull_image_get(img, &dhdr, sizeof(dhdr));
+    if (err)
+        return err;
+    if (!dhdr.quantum || !dhdr.qset || dhdr.quantum > INT_MAX || dhdr.qset > INT_MAX)
+        return -EINVAL;
+
+    scull_trim(dev);
+    dev->quantum = dhdr.quantum;
+    dev->qset = dhdr.qset;
+
+    for (n = 0; n < dhdr.nr_quanta; n++) {
+        err = scull_image_get(img, &qhdr, sizeof(qhdr));
+        if (err)
+            return err;
+        if (qhdr.index < next_index || qhdr.len > dev->quantum)
+            return -EINVAL;
+        item = div_u64_rem(qhdr.index, dev->qset, &s_pos);
+        /* the same limit as scull_locate(), past it nothing is reachable */
+        if (item > INT_MAX)
+            return -EINVAL;
+        next_index = qhdr.index + 1;
+
+        if (!dptr) {
+            dptr = dev->data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+            if (!dptr)
+                return -ENOMEM;
+        }
+        for (; cur < item; cur++) {
+            dptr->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+            if (!dptr->next)
+                return -ENOMEM;
+            dptr = dptr->next;
+        }
+        if (!dptr->data) {
+            dptr->data = kcalloc(dev->qset, sizeof(char *), GFP_KERNEL);
+            if (!dptr->data)
+                return -ENOMEM;
+        }
+        dptr->data[s_pos] = scull_alloc_quantum(dev);
+        if (!dptr->data[s_pos])
+            return -ENOMEM;
+        err = scull_image_get(img, dptr->data[s_pos], qhdr.len);
+        if (err)
+            return err;
+    }
+    dev->size = dhdr.size;
+    return 0;
+}
+
+
+/* Move the finished image in filp over path, which is in the same directory */
+static int scull_image_rename(struct file *filp, const char *path)
+{
+    struct dentry *old = filp->f_path.dentry;
+    struct dentry *dir = dget_parent(old);
+    const char *name = kbasename(path);
+    struct dentry *new;
+    int err;
+
+    lock_rename(dir, dir);
+    new = lookup_one_len(name, dir, strlen(name));
+    if (IS_ERR(new)) {
+        err = PTR_ERR(new);
+        goto out;
+    }
+    err = -ENOENT;      /* somebody moved the temporary file away */
+    if (old->d_parent == dir && !d_unhashed(old)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+        struct renamedata rd = {
+            .old_mnt_userns = file_mnt_user_ns(filp),
+            .old_dir = d_inode(dir),
+            .old_dentry = old,
+            .new_mnt_userns = file_mnt_user_ns(filp),
+            .new_dir = d_inode(dir),
+            .new_dentry = new,
+        };
+
+        err = vfs_rename(&rd);
+#else
+        err = vfs_rename(d_inode(dir), old, d_inode(dir), new, NULL, 0);
+#endif
+    }
+    dput(new);
+out:
+    unlock_rename(dir, dir);
+    dput(dir);
+    return err;
+}
+
+int scull_save(const char *path, struct scull_dev *devs, int nr_devs)
+{
+    struct scull_image img = { .pos = 0, .len = 0 };
+    struct scull_image_hdr hdr;
+    char *tmp;
+    int i, err;
+
+    tmp = kasprintf(GFP_KERNEL, "%s.tmp", path);
+    img.buf = kmalloc(SCULL_IMAGE_CHUNK, GFP_KERNEL);
+    if (!tmp || !img.buf) {
+        kfree(tmp);
+        kfree(img.buf);
+        return -ENOMEM;
+    }
+    img.filp = filp_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(img.filp)) {
+        kfree(tmp);
+        kfree(img.buf);
+        return PTR_ERR(img.filp);
+    }
+
+    hdr.magic = SCULL_IMAGE_MAGIC;
+    hdr.version = SCULL_IMAGE_VERSION;
+    hdr.nr_devs = nr_devs;
+    hdr.pad = 0;
+    err = scull_image_put(&img, &hdr, sizeof(hdr));
+    for (i = 0; !err && i < nr_devs; i++) {
+        mutex_lock(&devs[i].mutex);
+        err = scull_save_dev(&img, devs + i);
+        mutex_unlock(&devs[i].mutex);
+    }
+    if (!err)
+        err = scull_image_flush(&img);
+    if (!err)
+        err = vfs_fsync(img.filp, 0);
+    if (!err)
+        err = scull_image_rename(img.filp, path);
+
+    filp_close(img.filp, NULL);
+    kfree(tmp);
+    kfree(img.buf);
+    return err;
+}
+
+int scull_restore(const char *path, struct scull_dev *devs, int nr_devs)
+{
+    struct scull_image img = { .pos = 0, .len = 0, .off = 0 };
+    struct scull_image_hdr hdr;
+    int i, err;
+
+    img.buf = kmalloc(SCULL_IMAGE_CHUNK, GFP_KERNEL);
+    if (!img.buf)
+        return -ENOMEM;
+    img.filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(img.filp)) {
+        kfree(img.buf);
+        return PTR_ERR(img.filp);
+    }
+
+    err = scull_image_get(&img, &hdr, sizeof(hdr));
+    if (!err && (hdr.magic != SCULL_IMAGE_MAGIC || hdr.version != SCULL_IMAGE_VERSION))
+        err = -EINVAL;
+    for (i = 0; !err && i < min_t(u32, hdr.nr_devs, nr_devs); i++) {
+        mutex_lock(&devs[i].mutex);
+        err = scull_restore_dev(&img, devs + i);
+        if (err)
+            scull_trim(devs + i);   /* never leave a half-built device */
+        mutex_unlock(&devs[i].mutex);
+    }
+
+    filp_close(img.filp, NULL);
+    kfree(img.buf);
+    return err;
+}
@@ -11,140 +11,1277 @@
 #include <linux/types.h>	/* size_t */
 #include <linux/fcntl.h>
 #include <linux/poll.h>
+#include <linux/splice.h>	/* generic_file_splice_read() */
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/mm.h>		/* alloc_page(), kvzalloc() */
+#include <linux/vmalloc.h>	/* vmap() */
+#include <linux/capability.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>		/* copy_to_iter() */
+#include <linux/sched/clock.h>	/* local_clock() */
+#include <linux/sched/signal.h>	/* signal_pending() */
+#include <linux/eventfd.h>
+#include <linux/math64.h>	/* div_u64() */
+#include <linux/ktime.h>	/* ktime_get_ns() */
 
 #include "scull.h"		/* local definitions */
+#include "scull_trace.h"
 
 
+/*
+ * The ring memory: an array of pages, mapped contiguously with vmap()
+ * so the copy helpers see a flat buffer. Multi-megabyte rings then
+ * need no high-order allocation.
+ */
+struct scull_p_buf {
+    char *data;                         /* vmap() of pages */
+    unsigned int size;                  /* bytes, a power of two */
+    unsigned int nr_pages;
+    struct page **pages;
+};
+
+/*
+ * A per-CPU staging buffer of SCULL_P_MPMC mode, holding bytes in the
+ * same format as the ring until they are moved there in one piece.
+ */
+#define SCULL_P_STAGE   PAGE_SIZE
+
+struct scull_p_stage {
+    struct mutex lock;
+    unsigned int len;                   /* bytes staged */
+    u64 stamp;                          /* SCULL_P_TSTAMP: when the first came in */
+    char *data;                         /* SCULL_P_STAGE bytes, node local */
+};
+
+/*
+ * SCULL_P_TSTAMP: when each write went into the ring. An entry covers
+ * the bytes from its pos up to the next entry's, or up to wp. A write
+ * that finds the table full is charged to the newest entry, which can
+ * only make it look older than it is.
+ */
+#define SCULL_P_STAMPS  256
+#define SCULL_P_HIST    24              /* log2 buckets of microseconds */
+
+struct scull_p_stamp {
+    unsigned int pos;                   /* ring counter of the first byte */
+    u64 ns;                             /* ktime_get_ns() at enqueue */
+};
+
+/*
+ * A priority lane, see scull_p_write_lane(). Written and read under
+ * dev->mutex; the ring is allocated on the first write to the lane.
+ */
+struct scull_p_lane {
+    struct scull_p_buf *buf;
+    unsigned int rp, wp;
+};
+
+/*
+ * Counters behind /proc/scullpipe. They are per CPU so that the
+ * lockless SPSC paths never share a cache line for them; the proc
+ * file sums them, and a torn or slightly stale total is acceptable.
+ */
+struct scull_p_stats {
+    u64 bytes_in, bytes_out;
+    u64 short_reads, short_writes;
+    u64 rsleeps, wsleeps;               /* waits on inq and on outq */
+    u64 rsleep_ns, wsleep_ns;           /* time spent in them */
+    unsigned int peak;                  /* highest occupancy after a write */
+};
+
 struct scull_pipe {
     wait_queue_head_t inq, outq;        /* read and write queues */
-    char *buffer, *end;                 /* begin of buf, end of buf */
-    int buffersize;                     /* used in pointer arithmetic */
-    char *rp, *wp;                      /* where to read, where to write */
+    wait_queue_head_t laneq;            /* writers waiting for lane space */
+    struct scull_p_buf *buf;            /* the ring, while open */
+    unsigned int buffersize;            /* power of two, so masks wrap */
+    struct scull_p_ring_ctl *ctl;       /* rp/wp, a page shared with mmap() */
+    atomic_t mapped;                    /* vmas mapping the ring */
+    unsigned int flags;                 /* SCULL_P_* mode bits */
+    unsigned int rcvlowat, sndlowat;    /* wakeup thresholds, in bytes */
+    struct scull_p_stage __percpu *stage;   /* SCULL_P_MPMC write staging */
+    struct list_head readers;           /* scull_p_file of every reader */
+    struct scull_p_lane lane[SCULL_P_LANES - 1];    /* lanes 1 and up */
+    struct scull_p_stamp *stamps;       /* SCULL_P_TSTAMP table, a ring */
+    unsigned int stamp_head, stamp_len;
+    unsigned long hist[SCULL_P_HIST];   /* residency of the data read so far */
+    unsigned long dropped;              /* SCULL_P_DROP losses, without BCAST */
     int nreaders, nwriters;              /* number of openings for r/w */
     struct fasync_struct *async_queue;  /* asynchronous readers */
+    struct eventfd_ctx *evfd;           /* SCULL_P_IOCSEVENTFD binding */
+    unsigned int evfd_events;           /* POLLIN and/or POLLOUT */
+    spinlock_t evfd_lock;               /* keeps evfd alive while signalled */
+    struct scull_p_stats __percpu *stats;
+    struct rw_semaphore spsc_sem;       /* read-held across SPSC transfers */
+    unsigned int spsc_roles;            /* SCULL_P_ROLE_* some file has taken */
     struct mutex mutex;                 /* mutual exclusion semaphore */
     struct cdev cdev;
 };
 
+/* What each open file of a pipe keeps for itself */
+struct scull_p_file {
+    struct scull_pipe *dev;
+    int stage_cpu;                      /* stage holding our bytes, or -1 */
+    struct list_head list;              /* on dev->readers, if reading */
+    unsigned int rp;                    /* SCULL_P_BCAST read cursor */
+    unsigned long lost;                 /* bytes, or records, dropped past rp */
+    unsigned int busy_poll;             /* microseconds a reader spins first */
+    unsigned int lane;                  /* where our writes go, 0 is the main ring */
+    u64 stamp;                          /* SCULL_P_IOCGSTAMP of the last read */
+    unsigned int role;                  /* SCULL_P_ROLE_* taken, for SPSC */
+};
+
+static inline struct scull_pipe *scull_p_dev(struct file *filp)
+{
+    struct scull_p_file *pf = filp->private_data;
+
+    return pf->dev;
+}
+
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;   /* number of pipe devices */
 int scull_p_buffer = SCULL_P_BUFFER;    /* buffer size */
+static bool scull_p_spsc = false;       /* start pipes in SCULL_P_SPSC mode */
+module_param(scull_p_spsc, bool, S_IRUGO);
+static bool scull_p_persist = false;    /* start pipes in SCULL_P_PERSIST mode */
+module_param(scull_p_persist, bool, S_IRUGO);
+static bool scull_p_packet = false;     /* start pipes in SCULL_P_PACKET mode */
+module_param(scull_p_packet, bool, S_IRUGO);
+static bool scull_p_mpmc = false;       /* start pipes in SCULL_P_MPMC mode */
+module_param(scull_p_mpmc, bool, S_IRUGO);
+#define SCULL_P_BUSY_POLL_MAX 10000      /* microseconds */
+static int scull_p_busy_poll = 0;       /* default reader spin, in microseconds */
+module_param(scull_p_busy_poll, int, S_IRUGO);
+static int scull_p_pool_size = SCULL_P_NR_DEVS;   /* spare default-size rings */
+module_param(scull_p_pool_size, int, S_IRUGO);
+static int scull_p_max_buffer = 16 << 20;   /* resize limit without CAP_SYS_RESOURCE */
+module_param(scull_p_max_buffer, int, S_IRUGO);
+static int scull_p_lane_size = 4096;    /* ring of each priority lane */
+module_param(scull_p_lane_size, int, S_IRUGO);
 dev_t scull_p_devno;    /* Our first device number */
 
 static struct scull_pipe *scull_p_devices;
 
 
 static int spacefree(struct scull_pipe *dev);
+static void scull_p_bcast_tail(struct scull_pipe *dev);
+static void scull_p_drop(struct scull_pipe *dev, unsigned int need);
+static void scull_p_wake_writers(struct scull_pipe *dev);
+static ssize_t scull_p_read_bcast(struct file *filp, struct iov_iter *to, size_t count);
+static struct eventfd_ctx *scull_p_swap_eventfd(struct scull_pipe *dev,
+                                                struct eventfd_ctx *ctx,
+                                                unsigned int events);
+
+
+static void scull_p_buf_free(struct scull_p_buf *buf)
+{
+    unsigned int i;
+
+    if (!buf)
+        return;
+    if (buf->data)
+        vunmap(buf->data);
+    for (i = 0; i < buf->nr_pages; i++)
+        if (buf->pages[i])
+            __free_page(buf->pages[i]);
+    kvfree(buf->pages);
+    kfree(buf);
+}
+
+static struct scull_p_buf *scull_p_buf_alloc(unsigned int size)
+{
+    struct scull_p_buf *buf;
+    unsigned int i;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return NULL;
+    buf->size = size;
+    buf->nr_pages = size >> PAGE_SHIFT;
+    buf->pages = kvzalloc(buf->nr_pages * sizeof(struct page *), GFP_KERNEL);
+    if (!buf->pages)
+        goto fail;
+    for (i = 0; i < buf->nr_pages; i++) {
+        buf->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);   /* may be mmap()ed */
+        if (!buf->pages[i])
+            goto fail;
+    }
+    buf->data = vmap(buf->pages, buf->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (!buf->data)
+        goto fail;
+    return buf;
+
+fail:
+    scull_p_buf_free(buf);
+    return NULL;
+}
+
+/*
+ * A small pool of default-size rings, filled at load time, so that a
+ * pipe that is opened and closed at a high rate does not allocate and
+ * vmap a ring on every connect. Other sizes bypass the pool.
+ */
+static struct scull_p_buf **scull_p_pool;
+static int scull_p_pool_count;
+static DEFINE_SPINLOCK(scull_p_pool_lock);
+
+static struct scull_p_buf *scull_p_buf_get(unsigned int size)
+{
+    struct scull_p_buf *buf = NULL;
+
+    if (size == scull_p_buffer) {
+        spin_lock(&scull_p_pool_lock);
+        if (scull_p_pool_count)
+            buf = scull_p_pool[--scull_p_pool_count];
+        spin_unlock(&scull_p_pool_lock);
+        /* it still holds the last pipe's data, and may be mmap()ed */
+        if (buf)
+            memset(buf->data, 0, buf->size);
+    }
+    if (!buf)
+        buf = scull_p_buf_alloc(size);
+    return buf;
+}
+
+static void scull_p_buf_put(struct scull_p_buf *buf)
+{
+    if (buf && buf->size == scull_p_buffer) {
+        spin_lock(&scull_p_pool_lock);
+        if (scull_p_pool_count < scull_p_pool_size) {
+            scull_p_pool[scull_p_pool_count++] = buf;
+            buf = NULL;
+        }
+        spin_unlock(&scull_p_pool_lock);
+    }
+    scull_p_buf_free(buf);
+}
+
+static void scull_p_stage_free(struct scull_p_stage __percpu *stage)
+{
+    int cpu;
+
+    if (!stage)
+        return;
+    for_each_possible_cpu(cpu)
+        kfree(per_cpu_ptr(stage, cpu)->data);
+    free_percpu(stage);
+}
+
+static int scull_p_stage_alloc(struct scull_pipe *dev)
+{
+    struct scull_p_stage __percpu *stage;
+    struct scull_p_stage *st;
+    int cpu;
+
+    stage = alloc_percpu(struct scull_p_stage);
+    if (!stage)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(stage, cpu);
+        mutex_init(&st->lock);
+        st->data = kzalloc_node(SCULL_P_STAGE, GFP_KERNEL, cpu_to_node(cpu));
+        if (!st->data) {
+            scull_p_stage_free(stage);
+            return -ENOMEM;
+        }
+    }
+    dev->stage = stage;
+    return 0;
+}
+
+/* Free the lane rings and what is in them; only with the pipe closed */
+static void scull_p_lanes_free(struct scull_pipe *dev)
+{
+    int i;
+
+    for (i = 0; i < SCULL_P_LANES - 1; i++) {
+        scull_p_buf_free(dev->lane[i].buf);
+        dev->lane[i].buf = NULL;
+        dev->lane[i].rp = dev->lane[i].wp = 0;
+    }
+}
+
+/* Note that the bytes from pos on were written at ns; under dev->mutex */
+static void scull_p_stamp(struct scull_pipe *dev, unsigned int pos, u64 ns)
+{
+    if (!(dev->flags & SCULL_P_TSTAMP) || dev->stamp_len == SCULL_P_STAMPS)
+        return;
+    dev->stamps[(dev->stamp_head + dev->stamp_len) % SCULL_P_STAMPS].pos = pos;
+    dev->stamps[(dev->stamp_head + dev->stamp_len) % SCULL_P_STAMPS].ns = ns;
+    dev->stamp_len++;
+}
+
+/*
+ * rp moves from rp to to: retire the entries whose bytes are all gone,
+ * into the histogram if they were read rather than dropped. Returns
+ * when the first of the bytes was written, 0 if it was not stamped.
+ */
+static u64 scull_p_unstamp(struct scull_pipe *dev, unsigned int rp, unsigned int to,
+                           bool read)
+{
+    struct scull_p_stamp *ts;
+    unsigned int end;
+    u64 first = 0, now, us;
+
+    if (!dev->stamp_len)
+        return 0;
+    now = ktime_get_ns();
+    ts = dev->stamps + dev->stamp_head;
+    if ((int)(ts->pos - rp) <= 0)
+        first = ts->ns;
+    while (dev->stamp_len) {
+        ts = dev->stamps + dev->stamp_head;
+        end = dev->stamp_len > 1 ?
+              dev->stamps[(dev->stamp_head + 1) % SCULL_P_STAMPS].pos : dev->ctl->wp;
+        if ((int)(end - to) > 0)
+            break;
+        if (read) {
+            us = div_u64(now - ts->ns, NSEC_PER_USEC);
+            dev->hist[us ? min_t(unsigned int, ilog2(us) + 1, SCULL_P_HIST - 1) : 0]++;
+        }
+        dev->stamp_head = (dev->stamp_head + 1) % SCULL_P_STAMPS;
+        dev->stamp_len--;
+    }
+    return first;
+}
+
+/* Drop whatever is staged; only with the pipe closed, so without the locks */
+static void scull_p_stage_reset(struct scull_pipe *dev)
+{
+    int cpu;
+
+    if (!dev->stage)
+        return;
+    for_each_possible_cpu(cpu)
+        per_cpu_ptr(dev->stage, cpu)->len = 0;
+}
 
 
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
     struct scull_pipe *dev;
+    struct scull_p_file *pf;
+    bool wake;
 
     dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-    filp->private_data = dev;
+    pf = kmalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = dev;
+    pf->stage_cpu = -1;
+    pf->busy_poll = clamp(scull_p_busy_poll, 0, SCULL_P_BUSY_POLL_MAX);
+    pf->lane = 0;
+    pf->stamp = 0;
+    pf->role = 0;
+    filp->private_data = pf;
 
-    if (mutex_lock_interruptible(&dev->mutex))
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        kfree(pf);
         return -ERESTARTSYS;
+    }
 
-    if (!dev->buffer) {
-       
-        dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-        if (!dev->buffer) {
+    /*
+     * The lockless mode relies on one reader and one writer. A file
+     * open for one side takes it now; an O_RDWR one, which is what a
+     * mapping needs, waits until it reads or writes, or says which
+     * side it is with SCULL_P_IOCTROLE.
+     */
+    if (dev->flags & SCULL_P_SPSC) {
+        switch (filp->f_mode & (FMODE_READ | FMODE_WRITE)) {
+            case FMODE_READ:
+                pf->role = SCULL_P_ROLE_READ;
+                break;
+            case FMODE_WRITE:
+                pf->role = SCULL_P_ROLE_WRITE;
+                break;
+        }
+        if (dev->spsc_roles & pf->role) {
             mutex_unlock(&dev->mutex);
+            kfree(pf);
+            return -EBUSY;
+        }
+        dev->spsc_roles |= pf->role;
+    }
+
+    if (!dev->buf) {
+        dev->buf = scull_p_buf_get(dev->buffersize);
+        if (!dev->buf) {
+            mutex_unlock(&dev->mutex);
+            kfree(pf);
             return -ENOMEM;
         }
+        /* only a fresh buffer is reset, the other side may be using it */
+        dev->ctl->rp = dev->ctl->wp = 0;
+        dev->ctl->size = dev->buffersize;
+        dev->stamp_len = 0;
     }
-    dev->buffersize = scull_p_buffer;
-    dev->end = dev->buffer + dev->buffersize;
-    dev->rp = dev->wp = dev->buffer;    
 
  
-    if (filp->f_mode & FMODE_READ)
+    wake = false;
+    if (filp->f_mode & FMODE_READ) {
+        /* a new subscriber starts with the next byte written */
+        pf->rp = dev->ctl->wp;
+        pf->lost = 0;
+        list_add(&pf->list, &dev->readers);
         dev->nreaders++;
+        if (dev->flags & SCULL_P_BCAST) {
+            scull_p_bcast_tail(dev);    /* the first one frees the backlog */
+            wake = true;
+        }
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters++;
     mutex_unlock(&dev->mutex);
+    if (wake)
+        scull_p_wake_writers(dev);
 
     return nonseekable_open(inode, filp);
 }
 
-static int scull_p_release(struct inode *inode, struct file *filp)
+static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_pipe *dev = scull_p_dev(filp);
 
+    return fasync_helper(fd, filp, mode, &dev->async_queue);
+}
+
+static int scull_p_release(struct inode *inode, struct file *filp)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct eventfd_ctx *evfd = NULL;
+    bool wake = false;
 
-    mutex_lock_interruptible(&dev->mutex);
-    if (filp->f_mode & FMODE_READ)
+    scull_p_fasync(-1, filp, 0);
+    mutex_lock(&dev->mutex);
+    if (filp->f_mode & FMODE_READ) {
+        list_del(&pf->list);
         dev->nreaders--;
+        if (dev->flags & SCULL_P_BCAST) {
+            scull_p_bcast_tail(dev);    /* may free space for the writers */
+            wake = true;
+        }
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters--;
-    if (dev->nreaders + dev->nwriters == 0) {
-        kfree(dev->buffer);
-        dev->buffer = NULL;  
+    dev->spsc_roles &= ~pf->role;
+    /* a persistent pipe keeps its ring, and the data in it, for the next open */
+    if (dev->nreaders + dev->nwriters == 0 && !(dev->flags & SCULL_P_PERSIST)) {
+        scull_p_buf_put(dev->buf);
+        dev->buf = NULL;
+        scull_p_stage_reset(dev);
+        scull_p_lanes_free(dev);
     }
+    /* the eventfd binding goes with the last opener */
+    if (dev->nreaders + dev->nwriters == 0)
+        evfd = scull_p_swap_eventfd(dev, NULL, 0);
     mutex_unlock(&dev->mutex);
+    if (evfd)
+        eventfd_ctx_put(evfd);
+    if (wake)
+        scull_p_wake_writers(dev);
+    kfree(pf);
     return 0;
 }
 
 
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_ops)
+/*
+ * Readers are only woken once rcvlowat bytes are buffered and writers
+ * once sndlowat bytes are free, like SO_RCVLOWAT/SO_SNDLOWAT, so that
+ * byte-sized traffic can be batched into fewer wakeups. A blocked
+ * reader wants min(rcvlowat, count) bytes, a blocked writer the same
+ * amount of space; O_NONBLOCK callers take whatever is there.
+ */
+static unsigned int scull_p_target(unsigned int lowat, size_t count, unsigned int size)
+{
+    size_t target = min3((size_t)lowat, count, (size_t)size);
+
+    return target ? target : 1;
+}
+
+/* The highest lane with data in it, or NULL; lanes ignore rcvlowat */
+static struct scull_p_lane *scull_p_lane_ready(struct scull_pipe *dev)
+{
+    int i;
+
+    for (i = SCULL_P_LANES - 2; i >= 0; i--)
+        if (READ_ONCE(dev->lane[i].buf) &&
+            READ_ONCE(dev->lane[i].wp) != READ_ONCE(dev->lane[i].rp))
+            return dev->lane + i;
+    return NULL;
+}
+
+static bool scull_p_readable(struct scull_pipe *dev)
+{
+    unsigned int lowat = dev->flags & (SCULL_P_PACKET | SCULL_P_MPMC | SCULL_P_BCAST) ?
+                         1 : dev->rcvlowat;
+
+    if (scull_p_lane_ready(dev))
+        return true;
+    return READ_ONCE(dev->ctl->wp) - READ_ONCE(dev->ctl->rp) >=
+           min(lowat, dev->buffersize);
+}
+
+static bool scull_p_writable(struct scull_pipe *dev)
 {
-    struct scull_pipe *dev = filp->private_data;
+    return dev->buffersize - (READ_ONCE(dev->ctl->wp) - READ_ONCE(dev->ctl->rp)) >=
+           min(dev->sndlowat, dev->buffersize);
+}
+
+/*
+ * Readers and writers sleep as exclusive waiters, so a wakeup gets one
+ * task moving instead of the whole herd; whoever is woken and still
+ * leaves data (or space) behind passes the wakeup on to the next one.
+ * Poll waiters are not exclusive and always see the wakeup. Every
+ * transfer that leaves the pipe readable (writable) wakes again, not
+ * only the empty to non-empty transition, which is what EPOLLET users
+ * need; the poll key lets epoll skip entries not waiting for it.
+ */
+/*
+ * An eventfd bound with SCULL_P_IOCSEVENTFD is signalled along with
+ * the waitqueues, so event loops can watch the pipe through it.
+ */
+static void scull_p_signal_eventfd(struct scull_pipe *dev, unsigned int event)
+{
+    if (!READ_ONCE(dev->evfd))
+        return;
+    spin_lock(&dev->evfd_lock);
+    if (dev->evfd && (dev->evfd_events & event))
+        eventfd_signal(dev->evfd, 1);
+    spin_unlock(&dev->evfd_lock);
+}
 
+static void scull_p_wake_readers(struct scull_pipe *dev)
+{
+    if (!scull_p_readable(dev))
+        return;
+    if (wq_has_sleeper(&dev->inq))
+        wake_up_interruptible_poll(&dev->inq, POLLIN | POLLRDNORM);
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    scull_p_signal_eventfd(dev, POLLIN);
+}
+
+static void scull_p_wake_writers(struct scull_pipe *dev)
+{
+    if (!scull_p_writable(dev))
+        return;
+    if (wq_has_sleeper(&dev->outq))
+        wake_up_interruptible_poll(&dev->outq, POLLOUT | POLLWRNORM);
+    scull_p_signal_eventfd(dev, POLLOUT);
+}
+
+/* Swap in a new binding, returning the old one for the caller to put */
+static struct eventfd_ctx *scull_p_swap_eventfd(struct scull_pipe *dev,
+                                                struct eventfd_ctx *ctx,
+                                                unsigned int events)
+{
+    struct eventfd_ctx *old;
+
+    spin_lock(&dev->evfd_lock);
+    old = dev->evfd;
+    dev->evfd = ctx;
+    dev->evfd_events = events;
+    spin_unlock(&dev->evfd_lock);
+    return old;
+}
+
+static int scull_p_set_eventfd(struct scull_pipe *dev, void __user *arg)
+{
+    struct scull_p_eventfd req;
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.events & ~(POLLIN | POLLOUT))
+        return -EINVAL;
+    if (req.fd >= 0) {
+        ctx = eventfd_ctx_fdget(req.fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+    old = scull_p_swap_eventfd(dev, ctx, req.events);
+    if (old)
+        eventfd_ctx_put(old);
+
+    /* report a condition that already holds, as poll would */
+    scull_p_wake_readers(dev);
+    scull_p_wake_writers(dev);
+    return 0;
+}
+
+
+/*
+ * Lockless single-producer/single-consumer transfers.
+ *
+ * With SCULL_P_SPSC only one reader and one writer can have the pipe
+ * open, so rp is only ever stored by the reader and wp by the writer.
+ * Each side publishes its count with a release store after the copy
+ * and reads the other one with an acquire load, which orders the data
+ * accesses against the count updates; the mutex is left to open and
+ * release. Sleepers are woken only if wq_has_sleeper() sees one, whose
+ * barrier pairs with the one in prepare_to_wait().
+ */
+static size_t scull_p_space(struct scull_pipe *dev, unsigned int rp, unsigned int wp)
+{
+    return dev->buffersize - (wp - rp);
+}
+
+/*
+ * Copy count bytes out of / into the ring at counter pos. A transfer
+ * that crosses the end of the buffer is done as two segments, so the
+ * caller is only ever limited by data or space, never by the wrap.
+ * The iov_iter may be a user buffer or, for splice, a pipe; both
+ * return the bytes actually moved, less than count on a fault or a
+ * full pipe.
+ */
+static size_t scull_p_copy_out(struct scull_p_buf *buf, struct iov_iter *to,
+                               unsigned int pos, size_t count)
+{
+    unsigned int off = pos & (buf->size - 1);
+    size_t first = min(count, (size_t)(buf->size - off));
+    size_t done;
+
+    done = copy_to_iter(buf->data + off, first, to);
+    if (done == first && count > first)
+        done += copy_to_iter(buf->data, count - first, to);
+    return done;
+}
+
+static size_t scull_p_copy_in(struct scull_p_buf *buf, struct iov_iter *from,
+                              unsigned int pos, size_t count)
+{
+    unsigned int off = pos & (buf->size - 1);
+    size_t first = min(count, (size_t)(buf->size - off));
+    size_t done;
+
+    done = copy_from_iter(buf->data + off, first, from);
+    if (done == first && count > first)
+        done += copy_from_iter(buf->data, count - first, from);
+    return done;
+}
+
+/*
+ * Packet mode. Each write is stored as one record, a u32 length and
+ * then the payload padded to SCULL_P_HDR bytes, so headers are always
+ * aligned and never wrap. Writes are all or nothing, up to the ring
+ * size less a header (-EMSGSIZE beyond that); a read returns a single
+ * record and drops whatever of it did not fit, like SOCK_SEQPACKET.
+ */
+#define SCULL_P_HDR         sizeof(u32)
+#define SCULL_P_REC(len)    (SCULL_P_HDR + ALIGN((len), SCULL_P_HDR))
+
+/* bytes a read needs buffered, and a write needs free, before going ahead */
+static unsigned int scull_p_rtarget(struct scull_pipe *dev, size_t count)
+{
+    if (dev->flags & SCULL_P_PACKET)
+        return SCULL_P_HDR;
+    if (dev->flags & (SCULL_P_MPMC | SCULL_P_BCAST))
+        return 1;   /* staged bytes, or a slower reader, may hold the rest back */
+    return scull_p_target(dev->rcvlowat, count, dev->buffersize);
+}
+
+static unsigned int scull_p_wtarget(struct scull_pipe *dev, size_t count)
+{
+    if (dev->flags & SCULL_P_PACKET)
+        return SCULL_P_REC(count);
+    return scull_p_target(dev->sndlowat, count, dev->buffersize);
+}
+
+static bool scull_p_oversize(struct scull_pipe *dev, size_t count)
+{
+    return (dev->flags & SCULL_P_PACKET) && count > dev->buffersize - SCULL_P_HDR;
+}
+
+/*
+ * Copy out what one read returns at rp of buf, the main ring or a
+ * lane: up to *count bytes of the stream, or the record there.
+ * *count is set to the bytes copied, the return value is how far rp
+ * moves. A short copy still counts if it got anything across, as in
+ * pipe_read().
+ */
+static long scull_p_take(struct scull_pipe *dev, struct scull_p_buf *buf,
+                         struct iov_iter *to, size_t *count,
+                         unsigned int rp, unsigned int wp)
+{
+    unsigned int avail = wp - rp, len;
+    size_t want;
+
+    if (!(dev->flags & SCULL_P_PACKET)) {
+        want = min(*count, (size_t)avail);
+        *count = scull_p_copy_out(buf, to, rp, want);
+        if (!*count)
+            return -EFAULT;
+        return *count;
+    }
+
+    len = READ_ONCE(*(u32 *)(buf->data + (rp & (buf->size - 1))));
+    if (avail < SCULL_P_HDR || len > avail - SCULL_P_HDR ||
+        SCULL_P_REC(len) > avail)
+        return -EIO;
+    want = min(*count, (size_t)len);
+    *count = scull_p_copy_out(buf, to, rp + SCULL_P_HDR, want);
+    if (!*count && want)
+        return -EFAULT;
+    return SCULL_P_REC(len);
+}
+
+/*
+ * The other way round; space was checked against scull_p_wtarget().
+ * *count is updated for a short stream copy, a record goes in whole
+ * or not at all.
+ */
+static long scull_p_put(struct scull_pipe *dev, struct scull_p_buf *buf,
+                        struct iov_iter *from, size_t *count, unsigned int wp)
+{
+    size_t done;
+
+    if (!(dev->flags & SCULL_P_PACKET)) {
+        *count = scull_p_copy_in(buf, from, wp, *count);
+        if (!*count)
+            return -EFAULT;
+        return *count;
+    }
+
+    done = scull_p_copy_in(buf, from, wp + SCULL_P_HDR, *count);
+    if (done != *count)
+        return -EFAULT;
+    *(u32 *)(buf->data + (wp & (buf->size - 1))) = done;
+    return SCULL_P_REC(done);
+}
+
+/*
+ * Busy-poll, like SO_BUSY_POLL: spin on the ring for up to
+ * pf->busy_poll microseconds before paying for a sleep and a
+ * scheduler wakeup. The spin gives up as soon as the CPU is wanted
+ * elsewhere or a signal is pending; true if condition came true.
+ */
+#define scull_p_spin(pf, condition)                                     \
+({                                                                      \
+    u64 __end = local_clock() + (u64)(pf)->busy_poll * NSEC_PER_USEC;   \
+    bool __done = false;                                                \
+    if ((pf)->busy_poll)                                                \
+        while (!(__done = (condition)) && local_clock() < __end &&      \
+               !need_resched() && !signal_pending(current))             \
+            cpu_relax();                                                \
+    __done;                                                             \
+})
+
+/* schedule(), charging the time asleep to the reader or writer counters */
+static void scull_p_schedule(struct scull_pipe *dev, bool writer)
+{
+    struct scull_p_stats *st;
+    u64 start = local_clock();
+
+    schedule();
+    st = get_cpu_ptr(dev->stats);
+    if (writer) {
+        st->wsleeps++;
+        st->wsleep_ns += local_clock() - start;
+    } else {
+        st->rsleeps++;
+        st->rsleep_ns += local_clock() - start;
+    }
+    put_cpu_ptr(dev->stats);
+}
+
+/*
+ * wait_event_interruptible(), or its _exclusive() variant, that only
+ * counts real sleeps: a condition that already holds costs nothing,
+ * and each trip through schedule() is one sleep.
+ */
+#define scull_p_wait_event(dev, writer, wq, exclusive, condition)       \
+({                                                                      \
+    int __err = 0;                                                      \
+    might_sleep();                                                      \
+    if (!(condition))                                                   \
+        __err = ___wait_event(wq, condition, TASK_INTERRUPTIBLE,        \
+                              exclusive, 0,                             \
+                              scull_p_schedule(dev, writer));           \
+    __err;                                                              \
+})
+
+/*
+ * Sleep as an exclusive waiter with *flag raised, so that a peer
+ * working on the mmap()ed ring knows it has to SCULL_P_IOCKICK us.
+ * The barrier in prepare_to_wait() orders the flag store before the
+ * final check of the condition; the peer needs a full barrier between
+ * publishing its count and reading the flag.
+ */
+#define scull_p_wait(dev, writer, wq, flag, condition)                  \
+({                                                                      \
+    int __rc;                                                           \
+    WRITE_ONCE(*(flag), 1);                                             \
+    __rc = scull_p_wait_event(dev, writer, *(wq), 1, condition);        \
+    WRITE_ONCE(*(flag), 0);                                             \
+    __rc;                                                               \
+})
+
+static void scull_p_account(struct scull_pipe *dev, bool writer, size_t count, ssize_t ret)
+{
+    struct scull_p_stats *st;
+    unsigned int used;
+
+    if (ret <= 0)
+        return;
+    st = get_cpu_ptr(dev->stats);
+    if (writer) {
+        st->bytes_in += ret;
+        if (ret < count)
+            st->short_writes++;
+        used = READ_ONCE(dev->ctl->wp) - READ_ONCE(dev->ctl->rp);
+        if (used > st->peak)
+            st->peak = used;
+    } else {
+        st->bytes_out += ret;
+        /* a record shorter than the buffer is not a short read */
+        if (ret < count && !(dev->flags & SCULL_P_PACKET))
+            st->short_reads++;
+    }
+    put_cpu_ptr(dev->stats);
+}
+
+/*
+ * SPSC transfers run without the mutex, so each one holds spsc_sem
+ * for reading from its first look at the counters, waits included,
+ * until it has stored its own. Resizing the ring and changing the mode
+ * only go ahead if they can take it for writing, so they never pull
+ * the ring or the counters from under a transfer. A transfer that
+ * finds the mode already gone takes the mutex path instead.
+ */
+/* Take an SPSC side for this file, if nobody else has it */
+static int scull_p_take_role(struct scull_p_file *pf, unsigned int role)
+{
+    struct scull_pipe *dev = pf->dev;
+    int err = 0;
+
+    if ((READ_ONCE(pf->role) & role) == role)
+        return 0;
     if (mutex_lock_interruptible(&dev->mutex))
         return -ERESTARTSYS;
+    if (dev->spsc_roles & role & ~pf->role) {
+        err = -EBUSY;
+    } else {
+        dev->spsc_roles |= role;
+        WRITE_ONCE(pf->role, pf->role | role);
+    }
+    mutex_unlock(&dev->mutex);
+    return err;
+}
 
-    while (dev->rp == dev->wp) { 
-        mutex_unlock(&dev->mutex); /
-        if (filp->f_flags & O_NONBLOCK)
+static bool scull_p_spsc_begin(struct scull_pipe *dev)
+{
+    if (!(READ_ONCE(dev->flags) & SCULL_P_SPSC))
+        return false;
+    down_read(&dev->spsc_sem);
+    if (dev->flags & SCULL_P_SPSC)
+        return true;
+    up_read(&dev->spsc_sem);
+    return false;
+}
+
+static ssize_t scull_p_read_spsc(struct file *filp, struct iov_iter *to, size_t count)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int rp = dev->ctl->rp, wp;
+    unsigned int target = scull_p_rtarget(dev, count);
+    long moved;
+
+    while ((wp = smp_load_acquire(&dev->ctl->wp)) - rp < target) {
+        if (filp->f_flags & O_NONBLOCK) {
+            if (wp != rp)
+                break;
             return -EAGAIN;
+        }
+        if (scull_p_spin(pf, smp_load_acquire(&dev->ctl->wp) - rp >= target))
+            continue;
         PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-        if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-            return -ERESTARTSYS; 
-    
-        if (mutex_lock_interruptible(&dev->mutex))
+        if (scull_p_wait(dev, false, &dev->inq, &dev->ctl->rwait,
+                smp_load_acquire(&dev->ctl->wp) - rp >= target))
+            return -ERESTARTSYS;
+    }
+    if (wp - rp > dev->buffersize)
+        return -EIO;    /* a mapped producer scribbled over the counters */
+
+    moved = scull_p_take(dev, dev->buf, to, &count, rp, wp);
+    if (moved < 0)
+        return moved;
+    smp_store_release(&dev->ctl->rp, rp + moved);
+
+    scull_p_wake_writers(dev);
+    return count;
+}
+
+static ssize_t scull_p_write_spsc(struct file *filp, struct iov_iter *from, size_t count)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    unsigned int wp = dev->ctl->wp, rp;
+    unsigned int target;
+    size_t space;
+    long moved;
+
+    if (scull_p_oversize(dev, count))
+        return -EMSGSIZE;
+    target = scull_p_wtarget(dev, count);
+    while ((space = scull_p_space(dev, (rp = smp_load_acquire(&dev->ctl->rp)), wp)) < target) {
+        if (filp->f_flags & O_NONBLOCK) {
+            if (space && !(dev->flags & SCULL_P_PACKET))
+                break;
+            return -EAGAIN;
+        }
+        PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
+        if (scull_p_wait(dev, true, &dev->outq, &dev->ctl->wwait,
+                scull_p_space(dev, smp_load_acquire(&dev->ctl->rp), wp) >= target))
+            return -ERESTARTSYS;
+    }
+    if (wp - rp > dev->buffersize)
+        return -EIO;
+
+    count = min(count, space);
+    moved = scull_p_put(dev, dev->buf, from, &count, wp);
+    if (moved < 0)
+        return moved;
+    smp_store_release(&dev->ctl->wp, wp + moved);
+
+    scull_p_wake_readers(dev);
+    return count;
+}
+
+
+/*
+ * Multi-producer mode. Small writes are appended to the stage of the
+ * CPU they run on, under that stage's own lock, and only a full stage
+ * takes dev->mutex to move everything into the ring at once, so
+ * writers on different CPUs mostly stay off the shared cache lines.
+ * Bytes from one file are only ever in one stage: a writer that finds
+ * itself on another CPU, or has a write too big to stage, first
+ * flushes the stage it used last, which keeps each writer's data in
+ * FIFO order. Nobody sleeps holding a stage lock, so readers can
+ * always drain them. Staged bytes are pushed out as soon as a reader
+ * is waiting; the barrier in wq_has_sleeper() pairs with the one in
+ * prepare_to_wait(), and a reader's wait also checks the stages.
+ */
+static bool scull_p_staged(struct scull_pipe *dev)
+{
+    int cpu;
+
+    if (!(dev->flags & SCULL_P_MPMC))
+        return false;
+    for_each_possible_cpu(cpu)
+        if (READ_ONCE(per_cpu_ptr(dev->stage, cpu)->len))
+            return true;
+    return false;
+}
+
+/*
+ * A staged write may first have to move a whole stage into the ring,
+ * its own or that of the CPU it runs on, and gets -EAGAIN when that
+ * does not fit. Poll only reports POLLOUT when every stage would fit,
+ * or a non-blocking writer could spin between POLLOUT and -EAGAIN.
+ */
+static bool scull_p_stages_fit(struct scull_pipe *dev)
+{
+    size_t space;
+    int cpu;
+
+    if (!(dev->flags & SCULL_P_MPMC) || (dev->flags & SCULL_P_DROP))
+        return true;    /* nothing staged, or the flush makes room */
+    space = scull_p_space(dev, READ_ONCE(dev->ctl->rp), READ_ONCE(dev->ctl->wp));
+    for_each_possible_cpu(cpu)
+        if (READ_ONCE(per_cpu_ptr(dev->stage, cpu)->len) > space)
+            return false;
+    return true;
+}
+
+/* Move a whole stage into the ring, with st->lock held; -EAGAIN if it does not fit yet */
+static int scull_p_flush_stage(struct scull_pipe *dev, struct scull_p_stage *st)
+{
+    unsigned int off, first;
+
+    if (!st->len)
+        return 0;
+    mutex_lock(&dev->mutex);
+    if (dev->flags & SCULL_P_DROP)
+        scull_p_drop(dev, st->len);
+    if (spacefree(dev) < st->len) {
+        mutex_unlock(&dev->mutex);
+        return -EAGAIN;
+    }
+    off = dev->ctl->wp & (dev->buffersize - 1);
+    first = min(st->len, dev->buffersize - off);
+    memcpy(dev->buf->data + off, st->data, first);
+    memcpy(dev->buf->data, st->data + first, st->len - first);
+    scull_p_stamp(dev, dev->ctl->wp, st->stamp);
+    dev->ctl->wp += st->len;
+    mutex_unlock(&dev->mutex);
+    WRITE_ONCE(st->len, 0);
+
+    scull_p_wake_readers(dev);
+    return 0;
+}
+
+/* A reader pulls in whatever the ring has room for */
+static void scull_p_drain(struct scull_pipe *dev)
+{
+    struct scull_p_stage *st;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(dev->stage, cpu);
+        if (!READ_ONCE(st->len))
+            continue;
+        mutex_lock(&st->lock);
+        scull_p_flush_stage(dev, st);
+        mutex_unlock(&st->lock);
+    }
+}
+
+/* Flush one stage, waiting for room in the ring with the stage unlocked */
+static int scull_p_flush_wait(struct scull_pipe *dev, struct file *filp, int cpu)
+{
+    struct scull_p_stage *st = per_cpu_ptr(dev->stage, cpu);
+    int err;
+
+    for (;;) {
+        if (mutex_lock_interruptible(&st->lock))
+            return -ERESTARTSYS;
+        err = scull_p_flush_stage(dev, st);
+        mutex_unlock(&st->lock);
+        if (err != -EAGAIN)
+            return err;
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (scull_p_wait_event(dev, true, dev->outq, 0,
+                spacefree(dev) >= READ_ONCE(st->len)))
+            return -ERESTARTSYS;
+    }
+}
+
+static ssize_t scull_p_do_read(struct file *filp, struct iov_iter *to, size_t count)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_lane *lane;
+    unsigned int target;
+    long moved;
+
+    if (scull_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    target = scull_p_rtarget(dev, count);
+
+    while (dev->ctl->wp - dev->ctl->rp < target && !scull_p_lane_ready(dev)) {
+        if ((filp->f_flags & O_NONBLOCK) && dev->ctl->rp != dev->ctl->wp)
+            break;
+        mutex_unlock(&dev->mutex);
+        if (scull_p_staged(dev)) {
+            scull_p_drain(dev);     /* an empty ring has room for any stage */
+        } else {
+            if (filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            if (!scull_p_spin(pf, READ_ONCE(dev->ctl->wp) - READ_ONCE(dev->ctl->rp) >= target ||
+                              scull_p_lane_ready(dev))) {
+                PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+                if (scull_p_wait_event(dev, false, dev->inq, 1,
+                        READ_ONCE(dev->ctl->wp) - READ_ONCE(dev->ctl->rp) >= target ||
+                        scull_p_staged(dev) || scull_p_lane_ready(dev)))
+                    return -ERESTARTSYS;
+            }
+        }
+        if (scull_lock_interruptible(&dev->mutex))
             return -ERESTARTSYS;
     }
     
-    if (dev->wp > dev->rp)
-        count = min(count, (size_t)(dev->wp - dev->rp));
-    else 
-        count = min(count, (size_t)(dev->end - dev->rp));
-    if (copy_to_user(buf, dev->rp, count)) {
+    /* one read takes from one ring, the most urgent one with data */
+    lane = scull_p_lane_ready(dev);
+    if (lane)
+        moved = scull_p_take(dev, lane->buf, to, &count, lane->rp, lane->wp);
+    else
+        moved = scull_p_take(dev, dev->buf, to, &count, dev->ctl->rp, dev->ctl->wp);
+    if (moved < 0) {
         mutex_unlock(&dev->mutex);
-        return -EFAULT;
+        return moved;
+    }
+    if (lane) {
+        lane->rp += moved;
+        pf->stamp = 0;
+    } else {
+        pf->stamp = scull_p_unstamp(dev, dev->ctl->rp, dev->ctl->rp + moved, true);
+        dev->ctl->rp += moved;
     }
-    dev->rp += count;
-    if (dev->rp == dev->end)
-        dev->rp = dev->buffer; 
     mutex_unlock(&dev->mutex);
 
+    if (lane) {
+        if (wq_has_sleeper(&dev->laneq))
+            wake_up_interruptible_poll(&dev->laneq, POLLOUT | POLLWRNORM);
+    } else {
+        scull_p_wake_writers(dev);
+    }
+    scull_p_wake_readers(dev);  /* hand over to the next reader, if any data is left */
+    PDEBUGG("\"%s\" did read %li bytes\n", current->comm, (long)count);
+    return count;
+}
+
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_pipe *dev = scull_p_dev(filp);
+    size_t count = iov_iter_count(to);
+    ssize_t ret;
+
+    trace_scull_p_read_enter(MINOR(dev->cdev.dev), 0, count);
+    if (!count)
+        ret = 0;    /* and no record is consumed */
+    else if (scull_p_spsc_begin(dev)) {
+        ret = scull_p_take_role(filp->private_data, SCULL_P_ROLE_READ);
+        if (!ret)
+            ret = scull_p_read_spsc(filp, to, count);
+        up_read(&dev->spsc_sem);
+    } else if (dev->flags & SCULL_P_BCAST)
+        ret = scull_p_read_bcast(filp, to, count);
+    else
+        ret = scull_p_do_read(filp, to, count);
+    scull_p_account(dev, false, count, ret);
+    trace_scull_p_read_exit(MINOR(dev->cdev.dev), ret);
+    return ret;
+}
+
+/*
+ * Broadcast mode. Every reader has its own cursor into the ring and
+ * sees every byte (or record) written after it subscribed; ctl->rp is
+ * kept at the slowest cursor, so the writer is held back by the
+ * slowest reader, unless SCULL_P_DROP moves the laggards forward
+ * instead. All of it runs under dev->mutex.
+ */
+static void scull_p_bcast_tail(struct scull_pipe *dev)
+{
+    struct scull_p_file *pf;
+    unsigned int wp = dev->ctl->wp, lag = 0;
+
+    /* with nobody subscribed nothing is consumed; the next one skips it */
+    if (list_empty(&dev->readers))
+        return;
+    list_for_each_entry(pf, &dev->readers, list)
+        lag = max(lag, wp - pf->rp);
+    dev->ctl->rp = wp - lag;
+}
+
+static unsigned int scull_p_rec_at(struct scull_pipe *dev, unsigned int pos)
+{
+    return *(u32 *)(dev->buf->data + (pos & (dev->buffersize - 1)));
+}
+
+/*
+ * Flight-recorder mode. With SCULL_P_DROP a write that does not fit
+ * never waits: the oldest bytes, or whole records, are dropped until
+ * it does, and readers learn how much they missed from
+ * SCULL_P_IOCQLOST. In broadcast mode only the readers that had not
+ * consumed the dropped data are charged, each on its own count.
+ */
+static unsigned long scull_p_span(struct scull_pipe *dev, unsigned int from, unsigned int to)
+{
+    unsigned long n = 0;
+
+    if (!(dev->flags & SCULL_P_PACKET))
+        return to - from;
+    for (; from != to; from += SCULL_P_REC(scull_p_rec_at(dev, from)))
+        n++;
+    return n;
+}
+
+static void scull_p_drop(struct scull_pipe *dev, unsigned int need)
+{
+    struct scull_p_file *pf;
+    unsigned int wp = dev->ctl->wp, tail = dev->ctl->rp;
+    unsigned int limit = dev->buffersize - need;    /* what may stay buffered */
+
+    if (wp - tail <= limit)
+        return;
+    if (dev->flags & SCULL_P_PACKET) {
+        while (wp - tail > limit)
+            tail += SCULL_P_REC(scull_p_rec_at(dev, tail));
+    } else {
+        tail = wp - limit;
+    }
+
+    if (!(dev->flags & SCULL_P_BCAST)) {
+        dev->dropped += scull_p_span(dev, dev->ctl->rp, tail);
+    } else {
+        list_for_each_entry(pf, &dev->readers, list) {
+            if (wp - pf->rp <= wp - tail)
+                continue;
+            pf->lost += scull_p_span(dev, pf->rp, tail);
+            pf->rp = tail;
+        }
+    }
+    scull_p_unstamp(dev, dev->ctl->rp, tail, false);
+    dev->ctl->rp = tail;
+}
+
+static ssize_t scull_p_read_bcast(struct file *filp, struct iov_iter *to, size_t count)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int target;
+    long moved;
+
+    if (scull_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    target = scull_p_rtarget(dev, count);
+
+    while (dev->ctl->wp - pf->rp < target) {
+        mutex_unlock(&dev->mutex);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (!scull_p_spin(pf, READ_ONCE(dev->ctl->wp) - READ_ONCE(pf->rp) >= target)) {
+            PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+            /* not exclusive, every reader wants every wakeup */
+            if (scull_p_wait_event(dev, false, dev->inq, 0,
+                    READ_ONCE(dev->ctl->wp) - READ_ONCE(pf->rp) >= target))
+                return -ERESTARTSYS;
+        }
+        if (scull_lock_interruptible(&dev->mutex))
+            return -ERESTARTSYS;
+    }
+
+    moved = scull_p_take(dev, dev->buf, to, &count, pf->rp, dev->ctl->wp);
+    if (moved < 0) {
+        mutex_unlock(&dev->mutex);
+        return moved;
+    }
+    pf->rp += moved;
+    scull_p_bcast_tail(dev);
+    mutex_unlock(&dev->mutex);
 
-    wake_up_interruptible(&dev->outq);
-    PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
+    scull_p_wake_writers(dev);
     return count;
 }
 
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp, size_t count)
 {
-    while (spacefree(dev) == 0) {
-        DEFINE_WAIT(wait);
+    unsigned int target = scull_p_wtarget(dev, count);
 
+    /* a flight recorder makes room for the whole write, not just sndlowat */
+    if (dev->flags & SCULL_P_DROP)
+        scull_p_drop(dev, max_t(size_t, target, min_t(size_t, count, dev->buffersize)));
+
+    while (spacefree(dev) < target) {
+        if ((filp->f_flags & O_NONBLOCK) && spacefree(dev) &&
+            !(dev->flags & SCULL_P_PACKET))
+            break;
         mutex_unlock(&dev->mutex);
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
         PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
-        prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-        if (spacefree(dev) == 0)
-            schedule();
-        finish_wait(&dev->outq, &wait);
-        if (signal_pending(current))
+        if (scull_p_wait_event(dev, true, dev->outq, 1, spacefree(dev) >= target)) {
+            /* do not swallow a wakeup meant for another writer */
+            scull_p_wake_writers(dev);
             return -ERESTARTSYS;    
-        if (mutex_lock_interruptible(&dev->mutex))
+        }
+        if (scull_lock_interruptible(&dev->mutex))
             return -ERESTARTSYS;
     }
     return 0;
@@ -153,65 +1290,699 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 
 static int spacefree(struct scull_pipe *dev)
 {
-    if (dev->rp == dev->wp)
-        return dev->buffersize - 1;
-    return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+    return scull_p_space(dev, dev->ctl->rp, dev->ctl->wp);
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_ops)
+static ssize_t scull_p_do_write(struct file *filp, struct iov_iter *from, size_t count)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_pipe *dev = scull_p_dev(filp);
+    long moved;
     int result;
 
-    if (mutex_lock_interruptible(&dev->mutex))
+    if (scull_lock_interruptible(&dev->mutex))
         return -ERESTARTSYS;
-    
-   
-    result = scull_getwritespace(dev, filp);
+    if (scull_p_oversize(dev, count)) {
+        mutex_unlock(&dev->mutex);
+        return -EMSGSIZE;
+    }
+
+    result = scull_getwritespace(dev, filp, count);
     if (result)
         return result;  
 
    
     count = min(count, (size_t)spacefree(dev));
-    if (dev->wp >= dev->rp)
-        count = min(count, (size_t)(dev->end - dev->wp));   /* to end-of-buf */
-    else 
-        count = min(count, (size_t)(dev->rp - dev->wp -1));
-    PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-    if (copy_from_user(dev->wp, buf, count)){
+    PDEBUGG("Going to accept %li bytes to %u\n", (long)count, dev->ctl->wp);
+    moved = scull_p_put(dev, dev->buf, from, &count, dev->ctl->wp);
+    if (moved < 0) {
         mutex_unlock(&dev->mutex);
-        return -EFAULT;
+        return moved;
     }
-    dev->wp += count;
-    if (dev->wp == dev->end)
-        dev->wp = dev->buffer; 
+    scull_p_stamp(dev, dev->ctl->wp, ktime_get_ns());
+    dev->ctl->wp += moved;
     mutex_unlock(&dev->mutex);
 
     
-    wake_up_interruptible(&dev->inq);   
+    scull_p_wake_readers(dev);
+    scull_p_wake_writers(dev);  /* hand over to the next writer, if space is left */
+    PDEBUGG("\"%s\" did write %li bytes\n", current->comm, (long)count);
+    return count;
+}
 
-   
-    if (dev->async_queue)
-        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-    PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)count);
+static ssize_t scull_p_write_mpmc(struct file *filp, struct iov_iter *from, size_t count)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_stage *st;
+    size_t need, done;
+    int cpu, err;
+
+    if (scull_p_oversize(dev, count))
+        return -EMSGSIZE;
+    need = dev->flags & SCULL_P_PACKET ? SCULL_P_REC(count) : count;
+
+again:
+    cpu = raw_smp_processor_id();
+    if (pf->stage_cpu >= 0 && (pf->stage_cpu != cpu || need > SCULL_P_STAGE / 2)) {
+        err = scull_p_flush_wait(dev, filp, pf->stage_cpu);
+        if (err)
+            return err;
+        pf->stage_cpu = -1;
+    }
+    if (need > SCULL_P_STAGE / 2)
+        return scull_p_do_write(filp, from, count);
+
+    st = per_cpu_ptr(dev->stage, cpu);
+    if (mutex_lock_interruptible(&st->lock))
+        return -ERESTARTSYS;
+    if (st->len + need > SCULL_P_STAGE && scull_p_flush_stage(dev, st)) {
+        mutex_unlock(&st->lock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (scull_p_wait_event(dev, true, dev->outq, 0,
+                spacefree(dev) >= READ_ONCE(st->len)))
+            return -ERESTARTSYS;
+        goto again;
+    }
+
+    /* the time in the stage counts as time in the pipe */
+    if (!st->len && (dev->flags & SCULL_P_TSTAMP))
+        st->stamp = ktime_get_ns();
+    if (dev->flags & SCULL_P_PACKET) {
+        done = copy_from_iter(st->data + st->len + SCULL_P_HDR, count, from);
+        if (done != count) {
+            mutex_unlock(&st->lock);
+            return -EFAULT;
+        }
+        *(u32 *)(st->data + st->len) = count;
+    } else {
+        done = copy_from_iter(st->data + st->len, count, from);
+        if (!done) {
+            mutex_unlock(&st->lock);
+            return -EFAULT;
+        }
+        count = need = done;
+    }
+    WRITE_ONCE(st->len, st->len + need);
+    pf->stage_cpu = cpu;
+
+    if (wq_has_sleeper(&dev->inq))
+        scull_p_flush_stage(dev, st);
+    mutex_unlock(&st->lock);
+    return count;
+}
+
+/*
+ * Priority lanes. A file that picked a lane with SCULL_P_IOCTLANE
+ * writes to that lane's own small ring, and scull_p_do_read() empties
+ * the highest non-empty lane before it looks at the main ring, so a
+ * control message never queues behind bulk data. Lane writes always
+ * take the mutex: no staging, no dropping and no sndlowat. Their
+ * writers sleep on laneq, where a bulk writer cannot take a wakeup
+ * meant for them.
+ */
+static size_t scull_p_lane_space(struct scull_p_lane *lane)
+{
+    return lane->buf->size - (READ_ONCE(lane->wp) - READ_ONCE(lane->rp));
+}
+
+static bool scull_p_lane_writable(struct scull_pipe *dev, unsigned int nr)
+{
+    struct scull_p_lane *lane = dev->lane + nr - 1;
+
+    return !READ_ONCE(lane->buf) || scull_p_lane_space(lane) > 0;
+}
+
+static ssize_t scull_p_write_lane(struct file *filp, struct iov_iter *from, size_t count,
+                                  unsigned int nr)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    struct scull_p_lane *lane = dev->lane + nr - 1;
+    unsigned int target;
+    long moved;
+
+    if (scull_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (!lane->buf) {
+        lane->buf = scull_p_buf_alloc(scull_p_lane_size);
+        if (!lane->buf) {
+            mutex_unlock(&dev->mutex);
+            return -ENOMEM;
+        }
+        lane->rp = lane->wp = 0;
+    }
+    if ((dev->flags & SCULL_P_PACKET) && count > lane->buf->size - SCULL_P_HDR) {
+        mutex_unlock(&dev->mutex);
+        return -EMSGSIZE;
+    }
+    target = dev->flags & SCULL_P_PACKET ? SCULL_P_REC(count) : 1;
+
+    /* the ring stays while we have the pipe open, so it can be waited on unlocked */
+    while (scull_p_lane_space(lane) < target) {
+        mutex_unlock(&dev->mutex);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (scull_p_wait_event(dev, true, dev->laneq, 0,
+                scull_p_lane_space(lane) >= target))
+            return -ERESTARTSYS;
+        if (scull_lock_interruptible(&dev->mutex))
+            return -ERESTARTSYS;
+    }
+
+    count = min(count, scull_p_lane_space(lane));
+    moved = scull_p_put(dev, lane->buf, from, &count, lane->wp);
+    if (moved < 0) {
+        mutex_unlock(&dev->mutex);
+        return moved;
+    }
+    lane->wp += moved;
+    mutex_unlock(&dev->mutex);
+
+    scull_p_wake_readers(dev);
     return count;
 }
 
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int lane = READ_ONCE(pf->lane);
+    size_t count = iov_iter_count(from);
+    ssize_t ret;
+
+    trace_scull_p_write_enter(MINOR(dev->cdev.dev), 0, count);
+    if (!count)
+        ret = 0;    /* and no empty record is queued */
+    else if (scull_p_spsc_begin(dev)) {
+        ret = scull_p_take_role(pf, SCULL_P_ROLE_WRITE);
+        if (!ret)
+            ret = scull_p_write_spsc(filp, from, count);
+        up_read(&dev->spsc_sem);
+    } else if (lane && !(dev->flags & SCULL_P_BCAST))
+        ret = scull_p_write_lane(filp, from, count, lane);
+    else if (dev->flags & SCULL_P_MPMC)
+        ret = scull_p_write_mpmc(filp, from, count);
+    else
+        ret = scull_p_do_write(filp, from, count);
+    scull_p_account(dev, true, count, ret);
+    trace_scull_p_write_exit(MINOR(dev->cdev.dev), ret);
+    return ret;
+}
+
+/*
+ * Splice is stream only. The generic helpers cut a transfer to what
+ * the pipe has room for and cut writes wherever pages end, so with
+ * SCULL_P_PACKET the tail of a record would be dropped on the way
+ * out and records would be made up on the way in.
+ */
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+                                   struct pipe_inode_info *pipe, size_t len,
+                                   unsigned int flags)
+{
+    if (READ_ONCE(scull_p_dev(filp)->flags) & SCULL_P_PACKET)
+        return -EINVAL;
+    return generic_file_splice_read(filp, ppos, pipe, len, flags);
+}
+
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe, struct file *filp,
+                                    loff_t *ppos, size_t len, unsigned int flags)
+{
+    if (READ_ONCE(scull_p_dev(filp)->flags) & SCULL_P_PACKET)
+        return -EINVAL;
+    return iter_file_splice_write(pipe, filp, ppos, len, flags);
+}
+
+
+/*
+ * Poll takes no lock, the mask comes from a snapshot of rp and wp.
+ * The barrier after queueing pairs with the one in wq_has_sleeper():
+ * either we see the new counts or the waker sees us on the queue.
+ */
+static __poll_t scull_p_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int lane = READ_ONCE(pf->lane);
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->inq, wait);
+    poll_wait(filp, &dev->outq, wait);
+    if (lane)
+        poll_wait(filp, &dev->laneq, wait);
+    smp_mb();
+    if (dev->flags & SCULL_P_BCAST) {
+        if ((filp->f_mode & FMODE_READ) && READ_ONCE(dev->ctl->wp) != READ_ONCE(pf->rp))
+            mask |= EPOLLIN | EPOLLRDNORM;
+    } else if (scull_p_readable(dev) || scull_p_staged(dev)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (lane && !(dev->flags & (SCULL_P_SPSC | SCULL_P_BCAST))) {
+        if (scull_p_lane_writable(dev, lane))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    } else if (scull_p_writable(dev) && scull_p_stages_fit(dev)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+
+/*
+ * Resize the ring, like F_SETPIPE_SZ: the buffered bytes are moved to
+ * the start of a new ring, so nothing is dropped, and shrinking below
+ * what is buffered fails with -EBUSY. Returns the size actually used.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long size)
+{
+    struct scull_p_buf *nbuf, *obuf;
+    struct scull_p_file *pf;
+    unsigned int used, off, first, i;
+
+    if (size == 0 || size > (1UL << 30))
+        return -EINVAL;
+    size = roundup_pow_of_two(max_t(unsigned long, size, PAGE_SIZE));
+    if (size > scull_p_max_buffer && !capable(CAP_SYS_RESOURCE))
+        return -EPERM;
+
+    nbuf = scull_p_buf_alloc(size);
+    if (!nbuf)
+        return -ENOMEM;
+
+    /* SPSC transfers do not take the mutex, none may be in flight */
+    if (!down_write_trylock(&dev->spsc_sem)) {
+        scull_p_buf_free(nbuf);
+        return -EBUSY;
+    }
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        up_write(&dev->spsc_sem);
+        scull_p_buf_free(nbuf);
+        return -ERESTARTSYS;
+    }
+    used = dev->ctl->wp - dev->ctl->rp;
+    if (used > size || atomic_read(&dev->mapped)) {
+        mutex_unlock(&dev->mutex);
+        up_write(&dev->spsc_sem);
+        scull_p_buf_free(nbuf);
+        return -EBUSY;
+    }
+
+    obuf = dev->buf;
+    if (obuf) {
+        off = dev->ctl->rp & (dev->buffersize - 1);
+        first = min(used, dev->buffersize - off);
+        memcpy(nbuf->data, obuf->data + off, first);
+        memcpy(nbuf->data + first, obuf->data, used - first);
+    }
+    /* broadcast cursors keep their place relative to the data */
+    list_for_each_entry(pf, &dev->readers, list)
+        pf->rp -= dev->ctl->rp;
+    for (i = 0; i < dev->stamp_len; i++)
+        dev->stamps[(dev->stamp_head + i) % SCULL_P_STAMPS].pos -= dev->ctl->rp;
+    dev->buf = nbuf;
+    dev->buffersize = size;
+    dev->ctl->rp = 0;
+    dev->ctl->wp = used;
+    dev->ctl->size = size;
+    mutex_unlock(&dev->mutex);
+    up_write(&dev->spsc_sem);
+
+    scull_p_buf_put(obuf);
+    scull_p_wake_writers(dev);
+    return size;
+}
+
+static int scull_p_change_flags(struct scull_pipe *dev, unsigned int flags)
+{
+    struct scull_p_file *pf;
+    unsigned int changed;
+    int err;
+
+    if (flags & ~SCULL_P_FLAGS)
+        return -EINVAL;
+    if ((flags & SCULL_P_SPSC) && (flags & SCULL_P_MPMC))
+        return -EINVAL;
+    if ((flags & SCULL_P_BCAST) && (flags & (SCULL_P_SPSC | SCULL_P_MPMC)))
+        return -EINVAL;
+    /* the SPSC writer cannot move rp under the reader's feet */
+    if ((flags & SCULL_P_DROP) && (flags & SCULL_P_SPSC))
+        return -EINVAL;
+    /* stamps are kept under the mutex, on the one shared rp */
+    if ((flags & SCULL_P_TSTAMP) && (flags & (SCULL_P_SPSC | SCULL_P_BCAST)))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    changed = flags ^ dev->flags;
+    /* nobody else may be in a transfer while the locking scheme changes */
+    if ((changed & (SCULL_P_SPSC | SCULL_P_MPMC | SCULL_P_BCAST)) &&
+        dev->nreaders + dev->nwriters > 1) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    /* the ring holds either a stream or records, not both */
+    if ((changed & SCULL_P_PACKET) &&
+        (dev->ctl->wp != dev->ctl->rp || scull_p_staged(dev) ||
+         ((dev->flags & (SCULL_P_SPSC | SCULL_P_MPMC)) &&
+          dev->nreaders + dev->nwriters > 1))) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    /* lanes are only read on the mutex path, in the current format */
+    if ((changed & (SCULL_P_SPSC | SCULL_P_BCAST | SCULL_P_PACKET)) &&
+        scull_p_lane_ready(dev)) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    /* staged bytes must be read out before the stages go out of use */
+    if ((changed & SCULL_P_MPMC) && scull_p_staged(dev)) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    /* data already buffered has no time to go by */
+    if ((changed & flags & SCULL_P_TSTAMP) &&
+        (dev->ctl->wp != dev->ctl->rp || scull_p_staged(dev))) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    if ((flags & SCULL_P_TSTAMP) && !dev->stamps) {
+        dev->stamps = kmalloc_array(SCULL_P_STAMPS, sizeof(*dev->stamps), GFP_KERNEL);
+        if (!dev->stamps) {
+            mutex_unlock(&dev->mutex);
+            return -ENOMEM;
+        }
+    }
+    if ((flags & SCULL_P_MPMC) && !dev->stage) {
+        err = scull_p_stage_alloc(dev);
+        if (err) {
+            mutex_unlock(&dev->mutex);
+            return err;
+        }
+    }
+    /* mappings follow the SPSC protocol on the counters */
+    if (!(flags & SCULL_P_SPSC) && atomic_read(&dev->mapped)) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    if (changed & flags & SCULL_P_BCAST)
+        list_for_each_entry(pf, &dev->readers, list)
+            pf->rp = dev->ctl->rp;
+    if (changed & SCULL_P_TSTAMP)
+        dev->stamp_len = 0;
+    dev->flags = flags;
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+static int scull_p_setflags(struct scull_pipe *dev, unsigned int flags)
+{
+    int err;
+
+    /* an SPSC transfer in flight, even on this file, pins the mode */
+    if (!down_write_trylock(&dev->spsc_sem))
+        return -EBUSY;
+    err = scull_p_change_flags(dev, flags);
+    up_write(&dev->spsc_sem);
+    return err;
+}
+
+/* What was lost to SCULL_P_DROP since the last time anyone asked */
+static long scull_p_lost(struct file *filp)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned long *count;
+    long lost;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    /* without per-reader cursors, whoever asks first gets the lot */
+    count = dev->flags & SCULL_P_BCAST ? &pf->lost : &dev->dropped;
+    lost = min_t(unsigned long, *count, LONG_MAX);
+    *count = 0;
+    mutex_unlock(&dev->mutex);
+    return lost;
+}
+
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch(cmd) {
+        case SCULL_P_IOCTSIZE:
+            return scull_p_resize(dev, arg);
+
+        case SCULL_P_IOCQSIZE:
+            return dev->buffersize;
+
+        case SCULL_P_IOCSFLAGS:
+            return scull_p_setflags(dev, arg);
+
+        case SCULL_P_IOCQFLAGS:
+            return dev->flags;
+
+        case SCULL_P_IOCTRCVLOWAT:
+            if (arg < 1 || arg > INT_MAX)
+                return -EINVAL;
+            WRITE_ONCE(dev->rcvlowat, arg);
+            scull_p_wake_readers(dev);  /* a lower mark may already be met */
+            return 0;
+
+        case SCULL_P_IOCQRCVLOWAT:
+            return dev->rcvlowat;
+
+        case SCULL_P_IOCTSNDLOWAT:
+            if (arg < 1 || arg > INT_MAX)
+                return -EINVAL;
+            WRITE_ONCE(dev->sndlowat, arg);
+            scull_p_wake_writers(dev);
+            return 0;
+
+        case SCULL_P_IOCQSNDLOWAT:
+            return dev->sndlowat;
+
+        case SCULL_P_IOCKICK:
+            scull_p_wake_readers(dev);
+            scull_p_wake_writers(dev);
+            return 0;
+
+        case SCULL_P_IOCQLOST:
+            return scull_p_lost(filp);
+
+        case SCULL_P_IOCTBUSYPOLL:
+            if (arg > SCULL_P_BUSY_POLL_MAX)
+                return -EINVAL;
+            WRITE_ONCE(pf->busy_poll, arg);
+            return 0;
+
+        case SCULL_P_IOCQBUSYPOLL:
+            return pf->busy_poll;
+
+        case SCULL_P_IOCSEVENTFD:
+            return scull_p_set_eventfd(dev, (void __user *)arg);
+
+        case SCULL_P_IOCTLANE:
+            if (arg >= SCULL_P_LANES)
+                return -EINVAL;
+            WRITE_ONCE(pf->lane, arg);
+            return 0;
+
+        case SCULL_P_IOCQLANE:
+            return pf->lane;
+
+        case SCULL_P_IOCGSTAMP:
+            return put_user(pf->stamp, (__u64 __user *)arg);
+
+        case SCULL_P_IOCTROLE:
+            if (!arg || (arg & ~(SCULL_P_ROLE_READ | SCULL_P_ROLE_WRITE)))
+                return -EINVAL;
+            if (((arg & SCULL_P_ROLE_READ) && !(filp->f_mode & FMODE_READ)) ||
+                ((arg & SCULL_P_ROLE_WRITE) && !(filp->f_mode & FMODE_WRITE)))
+                return -EBADF;
+            if (!(READ_ONCE(dev->flags) & SCULL_P_SPSC))
+                return -EINVAL;
+            return scull_p_take_role(pf, arg);
+
+        default:
+            return -ENOTTY;
+    }
+}
+
+
+/*
+ * Shared-memory ring. Offset 0 maps the control page holding rp and
+ * wp, the data pages follow, and may be mapped twice in a row so that
+ * a wrapping block is contiguous in userspace. The mapping side runs
+ * the same SPSC protocol as scull_p_read_spsc()/scull_p_write_spsc()
+ * and may mix it with read() or write() on the other end; it only
+ * enters the kernel for SCULL_P_IOCKICK, or to poll() or block. A
+ * shared writable mapping needs an O_RDWR file, so the file has to
+ * take its side with SCULL_P_IOCTROLE before it can map.
+ */
+static void scull_p_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mapped);
+}
+
+static void scull_p_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mapped);
+}
+
+static const struct vm_operations_struct scull_p_vm_ops = {
+    .open =     scull_p_vma_open,
+    .close =    scull_p_vma_close,
+};
+
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = scull_p_dev(filp);
+    unsigned long i, pages = vma_pages(vma);
+    unsigned long addr = vma->vm_start;
+    int err;
+
+    /* a private copy of the counters would never reach the other side */
+    if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    err = -EINVAL;
+    if (!(dev->flags & SCULL_P_SPSC) || pages > 1 + 2 * dev->buf->nr_pages)
+        goto out;
+    if (!((struct scull_p_file *)filp->private_data)->role)
+        goto out;
+
+    err = vm_insert_page(vma, addr, virt_to_page(dev->ctl));
+    for (i = 1; !err && i < pages; i++) {
+        addr += PAGE_SIZE;
+        err = vm_insert_page(vma, addr,
+                             dev->buf->pages[(i - 1) % dev->buf->nr_pages]);
+    }
+    if (err)
+        goto out;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &scull_p_vm_ops;
+    vma->vm_private_data = dev;
+    atomic_inc(&dev->mapped);
+
+out:
+    mutex_unlock(&dev->mutex);
+    return err;
+}
+
 
-#ifdef SCULL_DEBUG
+/*
+ * /proc/scullpipe: what each pipe moved and how it ran. Everything is
+ * read without the device mutex, so a busy pipe may show a snapshot
+ * that was never true at any single instant.
+ */
+static void *scull_p_seq_start(struct seq_file *s, loff_t *pos)
+{
+    if (*pos >= scull_p_nr_devs)
+        return NULL;
+    return scull_p_devices + *pos;
+}
+
+static void *scull_p_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+    (*pos)++;
+    if (*pos >= scull_p_nr_devs)
+        return NULL;
+    return scull_p_devices + *pos;
+}
+
+static void scull_p_seq_stop(struct seq_file *s, void *v)
+{
+}
 
+static int scull_p_seq_show(struct seq_file *s, void *v)
+{
+    struct scull_pipe *dev = v;
+    struct scull_p_stats sum = { 0 }, *st;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(dev->stats, cpu);
+        sum.bytes_in += st->bytes_in;
+        sum.bytes_out += st->bytes_out;
+        sum.short_reads += st->short_reads;
+        sum.short_writes += st->short_writes;
+        sum.rsleeps += st->rsleeps;
+        sum.wsleeps += st->wsleeps;
+        sum.rsleep_ns += st->rsleep_ns;
+        sum.wsleep_ns += st->wsleep_ns;
+        sum.peak = max(sum.peak, st->peak);
+    }
+
+    seq_printf(s, "\nDevice %i: size %u, flags %#x, readers %i, writers %i\n",
+               (int)(dev - scull_p_devices), READ_ONCE(dev->buffersize),
+               READ_ONCE(dev->flags), READ_ONCE(dev->nreaders),
+               READ_ONCE(dev->nwriters));
+    seq_printf(s, " used %u, peak %u\n",
+               READ_ONCE(dev->ctl->wp) - READ_ONCE(dev->ctl->rp), sum.peak);
+    for (i = 0; i < SCULL_P_LANES - 1; i++)
+        if (READ_ONCE(dev->lane[i].buf))
+            seq_printf(s, " lane %i used %u\n", i + 1,
+                       READ_ONCE(dev->lane[i].wp) - READ_ONCE(dev->lane[i].rp));
+    seq_printf(s, " bytes in %llu, out %llu\n", sum.bytes_in, sum.bytes_out);
+    seq_printf(s, " short reads %llu, short writes %llu\n",
+               sum.short_reads, sum.short_writes);
+    seq_printf(s, " reader sleeps %llu, %llu us\n",
+               sum.rsleeps, div_u64(sum.rsleep_ns, NSEC_PER_USEC));
+    seq_printf(s, " writer sleeps %llu, %llu us\n",
+               sum.wsleeps, div_u64(sum.wsleep_ns, NSEC_PER_USEC));
 
-#endif 
+    /* how long data sat in the ring, with SCULL_P_TSTAMP */
+    for (i = 0; i < SCULL_P_HIST - 1; i++)
+        if (READ_ONCE(dev->hist[i]))
+            seq_printf(s, " residency < %lu us: %lu\n", 1UL << i, READ_ONCE(dev->hist[i]));
+    if (READ_ONCE(dev->hist[i]))
+        seq_printf(s, " residency >= %lu us: %lu\n", 1UL << (i - 1), READ_ONCE(dev->hist[i]));
+    return 0;
+}
+
+static struct seq_operations scull_p_seq_ops = {
+    .start = scull_p_seq_start,
+    .next  = scull_p_seq_next,
+    .stop  = scull_p_seq_stop,
+    .show  = scull_p_seq_show
+};
+
+static int scull_p_proc_open(struct inode *inode, struct file *file)
+{
+    return seq_open(file, &scull_p_seq_ops);
+}
+
+static const struct proc_ops scull_p_proc_ops = {
+    .proc_open    = scull_p_proc_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = seq_release
+};
 
 
 struct file_operations scull_pipe_fops = {
     .owner =    THIS_MODULE,
 
-    .read =     scull_p_read,
-    .write =    scull_p_write,
+    .read_iter =    scull_p_read_iter,
+    .write_iter =   scull_p_write_iter,
+    .splice_read =  scull_p_splice_read,
+    .splice_write = scull_p_splice_write,
+    .unlocked_ioctl = scull_p_ioctl,
+    .poll =     scull_p_poll,
+    .mmap =     scull_p_mmap,
 
     .open =     scull_p_open,
     .release =  scull_p_release,
+    .fasync =   scull_p_fasync,
 
 };
 
@@ -239,23 +2010,77 @@ int scull_p_init(dev_t firstdev)
         return 0;
     }
     scull_p_devno = firstdev;
+    /* the ring masks its counters, so it needs a power-of-two size */
+    if (scull_p_buffer < PAGE_SIZE)
+        scull_p_buffer = PAGE_SIZE;
+    scull_p_buffer = roundup_pow_of_two(scull_p_buffer);
+    if (scull_p_lane_size < PAGE_SIZE)
+        scull_p_lane_size = PAGE_SIZE;
+    scull_p_lane_size = roundup_pow_of_two(scull_p_lane_size);
     scull_p_devices = kmalloc(scull_p_nr_devs * sizeof(struct scull_pipe), GFP_KERNEL);
     if (scull_p_devices == NULL) {
         unregister_chrdev_region(firstdev, scull_p_nr_devs);
         return 0;
     }
     memset(scull_p_devices, 0, scull_p_nr_devs * sizeof(struct scull_pipe));
+    /* rp and wp get a page of their own, it is mapped into userspace */
+    for (i = 0; i < scull_p_nr_devs; i++) {
+        scull_p_devices[i].ctl = (void *)get_zeroed_page(GFP_KERNEL);
+        scull_p_devices[i].stats = alloc_percpu(struct scull_p_stats);
+        if (!scull_p_devices[i].ctl || !scull_p_devices[i].stats) {
+            i++;
+            goto fail_ctl;
+        }
+    }
+
+    /* a short pool is not fatal, open allocates what is missing */
+    if (scull_p_pool_size < 0)
+        scull_p_pool_size = 0;
+    scull_p_pool = kcalloc(scull_p_pool_size, sizeof(*scull_p_pool), GFP_KERNEL);
+    if (!scull_p_pool)
+        scull_p_pool_size = 0;
+    while (scull_p_pool_count < scull_p_pool_size) {
+        scull_p_pool[scull_p_pool_count] = scull_p_buf_alloc(scull_p_buffer);
+        if (!scull_p_pool[scull_p_pool_count])
+            break;
+        scull_p_pool_count++;
+    }
     for (i = 0; i < scull_p_nr_devs; i++) {
         init_waitqueue_head(&(scull_p_devices[i].inq));
         init_waitqueue_head(&(scull_p_devices[i].outq));
+        init_waitqueue_head(&(scull_p_devices[i].laneq));
+        INIT_LIST_HEAD(&scull_p_devices[i].readers);
+        spin_lock_init(&scull_p_devices[i].evfd_lock);
         mutex_init(&scull_p_devices[i].mutex);
+        init_rwsem(&scull_p_devices[i].spsc_sem);
+        scull_p_devices[i].buffersize = scull_p_buffer;
+        scull_p_devices[i].rcvlowat = 1;
+        scull_p_devices[i].sndlowat = 1;
+        if (scull_p_spsc)
+            scull_p_devices[i].flags |= SCULL_P_SPSC;
+        if (scull_p_persist)
+            scull_p_devices[i].flags |= SCULL_P_PERSIST;
+        if (scull_p_packet)
+            scull_p_devices[i].flags |= SCULL_P_PACKET;
+        if (scull_p_mpmc && !scull_p_spsc &&
+            !scull_p_stage_alloc(scull_p_devices + i))
+            scull_p_devices[i].flags |= SCULL_P_MPMC;
         scull_p_setup_cdev(scull_p_devices + i, i);
     }
 
-#ifdef SCULL_DEBUG
-
-#endif 
+    if (!proc_create("scullpipe", 0, NULL, &scull_p_proc_ops))
+        printk(KERN_WARNING "proc_create scullpipe failed\n");
     return scull_p_nr_devs;
+
+fail_ctl:
+    while (i--) {
+        free_page((unsigned long)scull_p_devices[i].ctl);
+        free_percpu(scull_p_devices[i].stats);
+    }
+    kfree(scull_p_devices);
+    scull_p_devices = NULL;
+    unregister_chrdev_region(firstdev, scull_p_nr_devs);
+    return 0;
 }
 
 
@@ -263,17 +2088,24 @@ void scull_p_cleanup(void)
 {
     int i;
 
-#ifdef SCULL_DEBUG
+    /* no problem if it was not registered */
     remove_proc_entry("scullpipe", NULL);
-#endif
 
     if (!scull_p_devices)
         return;     
     
     for (i = 0; i < scull_p_nr_devs; i++) {
         cdev_del(&scull_p_devices[i].cdev);
-        kfree(scull_p_devices[i].buffer);
+        scull_p_buf_free(scull_p_devices[i].buf);
+        free_page((unsigned long)scull_p_devices[i].ctl);
+        free_percpu(scull_p_devices[i].stats);
+        scull_p_lanes_free(scull_p_devices + i);
+        kfree(scull_p_devices[i].stamps);
+        scull_p_stage_free(scull_p_devices[i].stage);
     }
+    while (scull_p_pool_count)
+        scull_p_buf_free(scull_p_pool[--scull_p_pool_count]);
+    kfree(scull_p_pool);
     kfree(scull_p_devices);
     unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
     scull_p_devices = NULL; 
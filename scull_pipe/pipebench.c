@@ -0,0 +1,627 @@
+/*
+ * pipebench -- userspace load generator for /dev/scullpipeN.
+ *
+ *   pipebench herd [-d dev] [-r readers] [-n messages]
+ *   pipebench pingpong [-d dev] [-D dev] [-n messages]
+ *   pipebench stream [-d dev] [-n messages] [-s size]
+ *   pipebench scale [-d dev] [-p producers] [-c consumers] [-n messages]
+ *                   [-s size] [-w block|poll|epoll]
+ *
+ * herd: readers block in read() on one pipe while a single writer
+ * sends one-byte messages; reports context switches per message.
+ * Run it against the old and the new module to compare wakeup cost.
+ *
+ * pingpong: one-byte round trips over -d and back over -D, with
+ * latency percentiles. stream: one writer, one reader, -s byte
+ * writes; throughput and write() latency percentiles. scale: N
+ * producers and M consumers of -s byte messages on one pipe, waiting
+ * in a blocking call, in poll() or in epoll_wait().
+ *
+ * Give "pipe" or "socketpair" as -d to run the same test on a
+ * pipe(2) or an AF_UNIX socketpair(2) as a baseline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define MSG_DATA 'm'
+#define MSG_QUIT 'q'
+
+#define WAIT_BLOCK  0
+#define WAIT_POLL   1
+#define WAIT_EPOLL  2
+
+static const char *device = "/dev/scullpipe0";
+static const char *device2 = "/dev/scullpipe1";     /* pingpong return path */
+static int nreaders = 64;
+static long nmessages = 100000;
+static size_t msgsize = 65536;
+static int nproducers = 1, nconsumers = 1;
+static int waitmode = WAIT_BLOCK;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long csw(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static int xopen(const char *path, int flags)
+{
+    int fd = open(path, flags);
+
+    if (fd < 0) {
+        fprintf(stderr, "pipebench: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static void xwrite(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pipebench: write");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void xread(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("pipebench: read");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void *xmalloc(size_t len)
+{
+    void *p = malloc(len);
+
+    if (!p) {
+        fprintf(stderr, "pipebench: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * A one-way channel: a scullpipe device opened at both ends, or one of
+ * the baselines. Each device opening is a file of its own, the way
+ * separate processes would use the pipe.
+ */
+struct chan {
+    const char *path;
+    int rfd, wfd;
+};
+
+static int is_baseline(const char *path)
+{
+    return !strcmp(path, "pipe") || !strcmp(path, "socketpair");
+}
+
+static void chan_open(struct chan *ch, const char *path)
+{
+    int fds[2];
+
+    ch->path = path;
+    if (!strcmp(path, "pipe")) {
+        if (pipe(fds) < 0) {
+            perror("pipebench: pipe");
+            exit(1);
+        }
+    } else if (!strcmp(path, "socketpair")) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("pipebench: socketpair");
+            exit(1);
+        }
+    } else {
+        fds[0] = xopen(path, O_RDONLY);
+        fds[1] = xopen(path, O_WRONLY);
+    }
+    ch->rfd = fds[0];
+    ch->wfd = fds[1];
+}
+
+/* A descriptor for one more thread on the channel */
+static int chan_fd(struct chan *ch, int wr)
+{
+    if (is_baseline(ch->path))
+        return wr ? ch->wfd : ch->rfd;
+    return xopen(ch->path, wr ? O_WRONLY : O_RDONLY);
+}
+
+static void chan_put_fd(struct chan *ch, int fd)
+{
+    if (fd != ch->rfd && fd != ch->wfd)
+        close(fd);
+}
+
+static void chan_close(struct chan *ch)
+{
+    close(ch->wfd);
+    close(ch->rfd);
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Print percentiles of n samples, in seconds, as microseconds */
+static void report(const char *what, double *samples, long n)
+{
+    static const double pct[] = { 50, 90, 99, 99.9 };
+    unsigned int i;
+
+    if (n < 1)
+        return;
+    qsort(samples, n, sizeof(*samples), cmp_double);
+    printf("%s:", what);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+        printf(" p%g %.2f", pct[i], samples[(long)(pct[i] / 100 * (n - 1))] * 1e6);
+    printf(" max %.2f us\n", samples[n - 1] * 1e6);
+}
+
+
+static void *herd_reader(void *arg)
+{
+    int fd = *(int *)arg;
+    long got = 0;
+    char c;
+
+    for (;;) {
+        if (read(fd, &c, 1) != 1) {
+            if (errno == EINTR)
+                continue;
+            perror("pipebench: read");
+            exit(1);
+        }
+        if (c == MSG_QUIT)
+            break;
+        got++;
+    }
+    return (void *)got;
+}
+
+static int bench_herd(void)
+{
+    struct chan ch;
+    pthread_t *tids;
+    int rfd, wfd, i;
+    long c0, c1, got = 0;
+    double t0, t1;
+    char c = MSG_DATA, q = MSG_QUIT;
+    void *ret;
+
+    chan_open(&ch, device);
+    rfd = ch.rfd;
+    wfd = ch.wfd;
+    tids = calloc(nreaders, sizeof(*tids));
+    if (!tids)
+        return 1;
+
+    for (i = 0; i < nreaders; i++)
+        pthread_create(&tids[i], NULL, herd_reader, &rfd);
+    usleep(100000);     /* let every reader block */
+
+    c0 = csw();
+    t0 = now();
+    for (i = 0; i < nmessages; i++)
+        xwrite(wfd, &c, 1);
+    for (i = 0; i < nreaders; i++)
+        xwrite(wfd, &q, 1);
+    for (i = 0; i < nreaders; i++) {
+        pthread_join(tids[i], &ret);
+        got += (long)ret;
+    }
+    t1 = now();
+    c1 = csw();
+
+    printf("herd: %d readers, %ld messages (%ld received) in %.3f s\n",
+           nreaders, nmessages, got, t1 - t0);
+    printf("herd: %.2f context switches per message\n",
+           (double)(c1 - c0) / nmessages);
+
+    free(tids);
+    close(wfd);
+    close(rfd);
+    return 0;
+}
+
+
+static void *pong(void *arg)
+{
+    struct chan *ch = arg;      /* ch[0] comes in, ch[1] goes back */
+    char c;
+    long i;
+
+    for (i = 0; i < nmessages; i++) {
+        xread(ch[0].rfd, &c, 1);
+        xwrite(ch[1].wfd, &c, 1);
+    }
+    return NULL;
+}
+
+static int bench_pingpong(void)
+{
+    struct chan ch[2];
+    pthread_t tid;
+    double *lat, t0, t1, t;
+    char c = MSG_DATA;
+    long i;
+
+    chan_open(&ch[0], device);
+    chan_open(&ch[1], is_baseline(device) ? device : device2);
+    lat = xmalloc(nmessages * sizeof(*lat));
+    pthread_create(&tid, NULL, pong, ch);
+
+    t0 = now();
+    for (i = 0; i < nmessages; i++) {
+        t = now();
+        xwrite(ch[0].wfd, &c, 1);
+        xread(ch[1].rfd, &c, 1);
+        lat[i] = now() - t;
+    }
+    t1 = now();
+    pthread_join(tid, NULL);
+
+    printf("pingpong: %s, %ld round trips in %.3f s\n", device, nmessages, t1 - t0);
+    report("pingpong: round trip", lat, nmessages);
+
+    free(lat);
+    chan_close(&ch[1]);
+    chan_close(&ch[0]);
+    return 0;
+}
+
+
+static void *stream_reader(void *arg)
+{
+    struct chan *ch = arg;
+    long long left = (long long)nmessages * msgsize;
+    char *buf = xmalloc(msgsize);
+    ssize_t n;
+
+    while (left > 0) {
+        n = read(ch->rfd, buf, msgsize);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("pipebench: read");
+            exit(1);
+        }
+        left -= n;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int bench_stream(void)
+{
+    struct chan ch;
+    pthread_t tid;
+    double *lat, t0, t1, t;
+    char *buf;
+    long i;
+
+    chan_open(&ch, device);
+    buf = xmalloc(msgsize);
+    memset(buf, MSG_DATA, msgsize);
+    lat = xmalloc(nmessages * sizeof(*lat));
+    pthread_create(&tid, NULL, stream_reader, &ch);
+
+    t0 = now();
+    for (i = 0; i < nmessages; i++) {
+        t = now();
+        xwrite(ch.wfd, buf, msgsize);
+        lat[i] = now() - t;
+    }
+    pthread_join(tid, NULL);
+    t1 = now();
+
+    printf("stream: %s, %ld x %zu bytes in %.3f s, %.1f MB/s\n", device,
+           nmessages, msgsize, t1 - t0, nmessages * msgsize / (t1 - t0) / 1e6);
+    report("stream: write()", lat, nmessages);
+
+    free(lat);
+    free(buf);
+    chan_close(&ch);
+    return 0;
+}
+
+
+/*
+ * scale: producers split nmessages between them; consumers read until
+ * all of it has been consumed. Consumers still blocked in read() at
+ * the end are released by filler bytes from the main thread, which
+ * are not counted.
+ */
+struct scale_worker {
+    pthread_t tid;
+    struct chan *ch;
+    long messages;              /* producers: how many to send */
+    double *lat;                /* consumers: time in each read() */
+    long nlat;
+};
+
+static long long scale_total;
+static long long scale_consumed;    /* bytes, atomically */
+static int scale_alive;             /* consumers not yet done */
+
+/* Wait until fd is ready for events, in the configured way */
+static void scale_wait(int fd, int epfd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    struct epoll_event ev;
+
+    if (waitmode == WAIT_POLL)
+        poll(&pfd, 1, 100);
+    else
+        epoll_wait(epfd, &ev, 1, 100);
+}
+
+static int scale_setup(int fd, int wr)
+{
+    struct epoll_event ev = { .events = wr ? EPOLLOUT : EPOLLIN };
+    int epfd;
+
+    if (waitmode == WAIT_BLOCK)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (waitmode != WAIT_EPOLL)
+        return -1;
+    epfd = epoll_create1(0);
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("pipebench: epoll");
+        exit(1);
+    }
+    return epfd;
+}
+
+static void *scale_producer(void *arg)
+{
+    struct scale_worker *w = arg;
+    int fd = chan_fd(w->ch, 1), epfd = scale_setup(fd, 1);
+    char *buf = xmalloc(msgsize);
+    size_t off;
+    ssize_t n;
+    long i;
+
+    memset(buf, MSG_DATA, msgsize);
+    for (i = 0; i < w->messages; i++) {
+        for (off = 0; off < msgsize; off += n) {
+            n = write(fd, buf + off, msgsize - off);
+            if (n >= 0)
+                continue;
+            n = 0;
+            if (errno == EAGAIN)
+                scale_wait(fd, epfd, POLLOUT);
+            else if (errno != EINTR) {
+                perror("pipebench: write");
+                exit(1);
+            }
+        }
+    }
+    if (epfd >= 0)
+        close(epfd);
+    chan_put_fd(w->ch, fd);
+    free(buf);
+    return NULL;
+}
+
+static void *scale_consumer(void *arg)
+{
+    struct scale_worker *w = arg;
+    int fd = chan_fd(w->ch, 0), epfd = scale_setup(fd, 0);
+    char *buf = xmalloc(msgsize);
+    long cap = nmessages;
+    double t;
+    ssize_t n;
+
+    w->lat = xmalloc(cap * sizeof(*w->lat));
+    while (__atomic_load_n(&scale_consumed, __ATOMIC_RELAXED) < scale_total) {
+        t = now();
+        n = read(fd, buf, msgsize);
+        if (n > 0) {
+            if (w->nlat < cap)
+                w->lat[w->nlat++] = now() - t;
+            __atomic_add_fetch(&scale_consumed, n, __ATOMIC_RELAXED);
+        } else if (n < 0 && errno == EAGAIN) {
+            scale_wait(fd, epfd, POLLIN);
+        } else if (n == 0 || errno != EINTR) {
+            perror("pipebench: read");
+            exit(1);
+        }
+    }
+    __atomic_sub_fetch(&scale_alive, 1, __ATOMIC_RELAXED);
+    if (epfd >= 0)
+        close(epfd);
+    chan_put_fd(w->ch, fd);
+    free(buf);
+    return NULL;
+}
+
+static int bench_scale(void)
+{
+    static const char *modes[] = { "block", "poll", "epoll" };
+    struct scale_worker *prod, *cons;
+    struct chan ch;
+    double *lat, t0, t1;
+    char *filler;
+    long nlat = 0;
+    int i, ffd;
+
+    chan_open(&ch, device);
+    prod = calloc(nproducers, sizeof(*prod));
+    cons = calloc(nconsumers, sizeof(*cons));
+    filler = calloc(1, msgsize);
+    if (!prod || !cons || !filler)
+        return 1;
+    scale_total = (long long)nmessages * msgsize;
+    scale_alive = nconsumers;
+
+    t0 = now();
+    for (i = 0; i < nconsumers; i++) {
+        cons[i].ch = &ch;
+        pthread_create(&cons[i].tid, NULL, scale_consumer, &cons[i]);
+    }
+    for (i = 0; i < nproducers; i++) {
+        prod[i].ch = &ch;
+        prod[i].messages = nmessages / nproducers + (i < nmessages % nproducers);
+        pthread_create(&prod[i].tid, NULL, scale_producer, &prod[i]);
+    }
+    for (i = 0; i < nproducers; i++)
+        pthread_join(prod[i].tid, NULL);
+    while (__atomic_load_n(&scale_consumed, __ATOMIC_RELAXED) < scale_total)
+        usleep(1000);
+    t1 = now();
+
+    ffd = is_baseline(device) ? ch.wfd : xopen(device, O_WRONLY);
+    fcntl(ffd, F_SETFL, fcntl(ffd, F_GETFL) | O_NONBLOCK);
+    while (__atomic_load_n(&scale_alive, __ATOMIC_RELAXED)) {
+        if (write(ffd, filler, msgsize) < 0 && errno != EAGAIN)
+            break;
+        usleep(1000);
+    }
+    for (i = 0; i < nconsumers; i++)
+        pthread_join(cons[i].tid, NULL);
+    if (ffd != ch.wfd)
+        close(ffd);
+
+    printf("scale: %s, %d:%d %s, %ld x %zu bytes in %.3f s, %.0f msg/s, %.1f MB/s\n",
+           device, nproducers, nconsumers, modes[waitmode], nmessages, msgsize,
+           t1 - t0, nmessages / (t1 - t0), scale_total / (t1 - t0) / 1e6);
+    for (i = 0; i < nconsumers; i++)
+        nlat += cons[i].nlat;
+    lat = xmalloc((nlat ? nlat : 1) * sizeof(*lat));
+    for (nlat = 0, i = 0; i < nconsumers; i++) {
+        memcpy(lat + nlat, cons[i].lat, cons[i].nlat * sizeof(*lat));
+        nlat += cons[i].nlat;
+        free(cons[i].lat);
+    }
+    report("scale: read()", lat, nlat);
+
+    free(lat);
+    free(filler);
+    free(cons);
+    free(prod);
+    chan_close(&ch);
+    return 0;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: pipebench herd [-d dev] [-r readers] [-n messages]\n"
+            "       pipebench pingpong [-d dev] [-D dev] [-n messages]\n"
+            "       pipebench stream [-d dev] [-n messages] [-s size]\n"
+            "       pipebench scale [-d dev] [-p producers] [-c consumers] [-n messages]\n"
+            "                       [-s size] [-w block|poll|epoll]\n"
+            "dev may be \"pipe\" or \"socketpair\" for a baseline\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode;
+    int opt;
+
+    if (argc < 2)
+        usage();
+    mode = argv[1];
+    optind = 2;
+    while ((opt = getopt(argc, argv, "d:D:r:n:s:p:c:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                device = optarg;
+                break;
+            case 'D':
+                device2 = optarg;
+                break;
+            case 'r':
+                nreaders = atoi(optarg);
+                break;
+            case 'n':
+                nmessages = atol(optarg);
+                break;
+            case 's':
+                msgsize = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                nproducers = atoi(optarg);
+                break;
+            case 'c':
+                nconsumers = atoi(optarg);
+                break;
+            case 'w':
+                if (!strcmp(optarg, "block"))
+                    waitmode = WAIT_BLOCK;
+                else if (!strcmp(optarg, "poll"))
+                    waitmode = WAIT_POLL;
+                else if (!strcmp(optarg, "epoll"))
+                    waitmode = WAIT_EPOLL;
+                else
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+    if (nreaders < 1 || nmessages < 1 || msgsize < 1 ||
+        nproducers < 1 || nconsumers < 1)
+        usage();
+
+    if (!strcmp(mode, "herd"))
+        return bench_herd();
+    if (!strcmp(mode, "pingpong"))
+        return bench_pingpong();
+    if (!strcmp(mode, "stream"))
+        return bench_stream();
+    if (!strcmp(mode, "scale"))
+        return bench_scale();
+    usage();
+    return 2;
+}
@@ -3,6 +3,10 @@
 #ifndef _SCULL_H
 #define _SCULL_H
 
+/*
+ * The module builds against Linux 5.6 through 6.2: it needs struct
+ * proc_ops (5.6), and vfs_rename() takes an idmap from 6.3 on.
+ */
 
 #undef PDEBUG           
 #ifdef SCULL_DEBUG
@@ -34,9 +38,30 @@
 
 
 #ifndef SCULL_P_BUFFER
-#define SCULL_P_BUFFER 4000 
+#define SCULL_P_BUFFER 4096     /* rounded up to a power of two anyway */
 #endif
 
+/*
+ * Lane 0 is the main ring; lanes 1 and up are small rings of their own
+ * that readers empty first, the highest one first.
+ */
+#define SCULL_P_LANES 4
+
+/*
+ * scullpipe mode bits
+ */
+#define SCULL_P_SPSC    0x0001  /* one reader, one writer, lockless transfers */
+#define SCULL_P_PERSIST 0x0002  /* keep the ring and its data across close */
+#define SCULL_P_PACKET  0x0004  /* a write is one record, a read returns one; no splice */
+#define SCULL_P_MPMC    0x0008  /* many writers, staged per CPU; not with SPSC */
+#define SCULL_P_BCAST   0x0010  /* every reader gets every byte; not with SPSC/MPMC */
+#define SCULL_P_DROP    0x0020  /* a full ring drops the oldest data; not with SPSC */
+#define SCULL_P_TSTAMP  0x0040  /* time data in the ring; not with SPSC/BCAST */
+
+#define SCULL_P_FLAGS   (SCULL_P_SPSC | SCULL_P_PERSIST | SCULL_P_PACKET | \
+                         SCULL_P_MPMC | SCULL_P_BCAST | SCULL_P_DROP | \
+                         SCULL_P_TSTAMP)
+
 #ifndef SCULL_QUANTUM
 #define SCULL_QUANTUM 4000
 #endif
@@ -59,6 +84,9 @@
      int qset;                  /* the current array size */
      unsigned long size;        /* amount of data stored here */
      unsigned int access_key;   /* used by sculluid and scullpriv */
+     int numa_policy;           /* SCULL_NUMA_* for new quanta */
+     int numa_node;             /* target node of SCULL_NUMA_BIND */
+     int numa_next;             /* next node of SCULL_NUMA_INTERLEAVE */
      struct mutex mutex;        /* mutual exclusion semaphore */
      struct cdev cdev;          /* Char device structure */
  };
@@ -92,11 +120,140 @@
  #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC, 13)
  #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC, 14)
 
+/*
+ * Per-device placement of newly allocated quanta.
+ */
+#define SCULL_NUMA_DEFAULT     0    /* plain kmalloc(), the task's mempolicy */
+#define SCULL_NUMA_LOCAL       1    /* node of the writing CPU */
+#define SCULL_NUMA_INTERLEAVE  2    /* round-robin over online nodes */
+#define SCULL_NUMA_BIND        3    /* always scull_numa.node */
+
+struct scull_numa {
+    int policy;
+    int node;
+};
+
+#define SCULL_IOCSNUMA      _IOW(SCULL_IOC_MAGIC, 15, struct scull_numa)
+#define SCULL_IOCGNUMA      _IOR(SCULL_IOC_MAGIC, 16, struct scull_numa)
+
+/*
+ * Map of the populated byte ranges of a device, in the spirit of
+ * FS_IOC_FIEMAP: the caller passes the header followed by room for
+ * nr_extents entries, and gets back the extents at or after start.
+ */
+struct scull_extent {
+    __u64 offset;
+    __u64 length;
+};
+
+#define SCULL_EXTMAP_LAST   0x1     /* no populated data past the last extent */
+
+struct scull_extent_map {
+    __u64 start;                    /* in: first byte to map */
+    __u32 nr_extents;               /* in: room in extents[] */
+    __u32 mapped;                   /* out: extents filled in */
+    __u32 flags;                    /* out: SCULL_EXTMAP_* */
+    __u32 reserved;
+    struct scull_extent extents[0];
+};
+
+#define SCULL_IOCEXTMAP     _IOWR(SCULL_IOC_MAGIC, 17, struct scull_extent_map)
+
+/* scullpipe mode bits, SCULL_P_* above */
+#define SCULL_P_IOCSFLAGS   _IO(SCULL_IOC_MAGIC, 18)
+#define SCULL_P_IOCQFLAGS   _IO(SCULL_IOC_MAGIC, 19)
 
-#define SCULL_IOC_MAXNR 14
+/* scullpipe wakeup low-watermarks, in bytes */
+#define SCULL_P_IOCTRCVLOWAT _IO(SCULL_IOC_MAGIC, 20)
+#define SCULL_P_IOCQRCVLOWAT _IO(SCULL_IOC_MAGIC, 21)
+#define SCULL_P_IOCTSNDLOWAT _IO(SCULL_IOC_MAGIC, 22)
+#define SCULL_P_IOCQSNDLOWAT _IO(SCULL_IOC_MAGIC, 23)
+
+/*
+ * Control page of a mapped scullpipe ring, at mmap() offset 0 with the
+ * data pages right after it (SCULL_P_SPSC pipes only). rp and wp are
+ * free-running byte counts, the offset into the data is count & (size - 1).
+ * Load the peer's count with acquire and store your own with release;
+ * after a store, a full barrier and then a non-zero rwait/wwait means
+ * the kernel side is asleep and wants a SCULL_P_IOCKICK. Each side's
+ * fields sit on their own cache line. With SCULL_P_PACKET the data is
+ * a sequence of records, each a __u32 length followed by the payload
+ * padded to a multiple of 4 bytes.
+ *
+ * The mapping must be MAP_SHARED and writable, since each side stores
+ * its own count, so a mapping side opens the pipe O_RDWR and takes its
+ * side with SCULL_P_IOCTROLE before mmap(). The other end may open
+ * O_RDONLY or O_WRONLY and use read() or write(), or map as well.
+ */
+struct scull_p_ring_ctl {
+    __u32 wp;           /* stored by the writer */
+    __u32 wwait;        /* a writer sleeps in the kernel */
+    __u32 pad0[14];
+    __u32 rp;           /* stored by the reader */
+    __u32 rwait;        /* a reader sleeps in the kernel */
+    __u32 pad1[14];
+    __u32 size;         /* data bytes, a power of two */
+};
+
+#define SCULL_P_IOCKICK     _IO(SCULL_IOC_MAGIC, 24)
+
+/* bytes (records with SCULL_P_PACKET) lost to SCULL_P_DROP since last asked */
+#define SCULL_P_IOCQLOST    _IO(SCULL_IOC_MAGIC, 25)
+
+/* microseconds a reader of this file busy-polls before sleeping */
+#define SCULL_P_IOCTBUSYPOLL _IO(SCULL_IOC_MAGIC, 26)
+#define SCULL_P_IOCQBUSYPOLL _IO(SCULL_IOC_MAGIC, 27)
+
+/*
+ * Bind an eventfd that the pipe signals whenever it becomes readable
+ * (POLLIN) or writable (POLLOUT); fd -1 unbinds. One per pipe, and it
+ * is dropped when the last opener closes.
+ */
+struct scull_p_eventfd {
+    __s32 fd;
+    __u32 events;
+};
+
+#define SCULL_P_IOCSEVENTFD _IOW(SCULL_IOC_MAGIC, 28, struct scull_p_eventfd)
+
+/* priority lane this file writes to; ignored with SPSC and BCAST */
+#define SCULL_P_IOCTLANE    _IO(SCULL_IOC_MAGIC, 29)
+#define SCULL_P_IOCQLANE    _IO(SCULL_IOC_MAGIC, 30)
+
+/*
+ * With SCULL_P_TSTAMP, when the oldest byte of this file's last read
+ * was written, in CLOCK_MONOTONIC nanoseconds; 0 if it was not stamped
+ * (a priority lane, or the mode was off).
+ */
+#define SCULL_P_IOCGSTAMP   _IOR(SCULL_IOC_MAGIC, 31, __u64)
+
+/*
+ * The side of an SCULL_P_SPSC pipe a file plays. O_RDONLY and O_WRONLY
+ * files take theirs at open, O_RDWR ones on their first read or write,
+ * or here; taking a side somebody else has fails with EBUSY.
+ */
+#define SCULL_P_ROLE_READ   0x1
+#define SCULL_P_ROLE_WRITE  0x2
+#define SCULL_P_IOCTROLE    _IO(SCULL_IOC_MAGIC, 32)
+
+
+#define SCULL_IOC_MAXNR 32
 
 
 int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
+int     scull_trim(struct scull_dev *dev);
+struct scull_qset *scull_follow(struct scull_dev *dev, int n);
+struct scull_qset *scull_lookup(struct scull_dev *dev, int n);
+int     scull_locate(struct scull_dev *dev, loff_t pos, int *item, int *s_pos, int *q_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
+loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
+int     scull_lock_interruptible(struct mutex *lock);
+void    *scull_alloc_quantum(struct scull_dev *dev);
+
+extern char *scull_backing;
+int     scull_save(const char *path, struct scull_dev *devs, int nr_devs);
+int     scull_restore(const char *path, struct scull_dev *devs, int nr_devs);
 
 #endif /* SCULL_H */
@@ -0,0 +1,425 @@
+/*
+ * scull_kunit.c -- KUnit tests and microbenchmarks for the scull core
+ *
+ * Runs without hardware on the kernels the module supports (5.6 to
+ * 6.2, see scull.h) and uses only KUnit macros those kernels all have.
+ * Out of tree, build with "make CONFIG_SCULL_KUNIT_TEST=m" and load
+ * scull_kunit.ko after scull.ko. From 5.12 on, a kernel tree that has
+ * this directory in it can also run it under UML:
+ *
+ *	./tools/testing/kunit/kunit.py run --kunitconfig=<this directory>
+ *
+ * Results come out as KTAP; the benchmarks report their numbers as
+ * "#" diagnostic lines.
+ *
+ * The tests use a small geometry (8-byte quanta, 4 per qset) so that
+ * every quantum and qset edge is a few bytes away, and a struct file
+ * of their own, so no device node is needed.
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/cdev.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>	/* div64_u64() */
+
+#include "scull.h"
+
+#define SCULL_TEST_QUANTUM  8
+#define SCULL_TEST_QSET     4
+#define SCULL_TEST_ITEM     (SCULL_TEST_QUANTUM * SCULL_TEST_QSET)
+
+#define SCULL_BENCH_DEPTH   4096                /* qset nodes walked */
+#define SCULL_BENCH_WALKS   64
+#define SCULL_BENCH_FILL    (8 * 1024 * 1024)   /* bytes written */
+
+struct scull_test {
+    struct scull_dev dev;
+    struct file filp;
+};
+
+static int scull_test_init(struct kunit *test)
+{
+    struct scull_test *t;
+
+    t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+    mutex_init(&t->dev.mutex);
+    t->dev.quantum = SCULL_TEST_QUANTUM;
+    t->dev.qset = SCULL_TEST_QSET;
+    t->filp.private_data = &t->dev;
+    test->priv = t;
+    return 0;
+}
+
+static void scull_test_exit(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+
+    scull_trim(&t->dev);
+}
+
+/*
+ * One read or write at *pos through a kernel buffer, the way the VFS
+ * calls scull for read(2) and write(2).
+ */
+static ssize_t scull_test_io(struct scull_test *t, bool write,
+                             void *buf, size_t len, loff_t *pos)
+{
+    struct kiocb iocb = { .ki_filp = &t->filp, .ki_pos = *pos };
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+    ssize_t ret;
+
+    iov_iter_kvec(&iter, write ? WRITE : READ, &kv, 1, len);
+    if (write)
+        ret = scull_write_iter(&iocb, &iter);
+    else
+        ret = scull_read_iter(&iocb, &iter);
+    *pos = iocb.ki_pos;
+    return ret;
+}
+
+static int scull_test_nodes(struct scull_dev *dev)
+{
+    struct scull_qset *qs;
+    int n = 0;
+
+    for (qs = dev->data; qs; qs = qs->next)
+        n++;
+    return n;
+}
+
+static void scull_test_locate(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    int item, s_pos, q_pos;
+
+    KUNIT_EXPECT_EQ(test, 0, scull_locate(&t->dev, 0, &item, &s_pos, &q_pos));
+    KUNIT_EXPECT_EQ(test, 0, item);
+    KUNIT_EXPECT_EQ(test, 0, s_pos);
+    KUNIT_EXPECT_EQ(test, 0, q_pos);
+
+    /* last byte of a quantum, first of the next */
+    scull_locate(&t->dev, SCULL_TEST_QUANTUM - 1, &item, &s_pos, &q_pos);
+    KUNIT_EXPECT_EQ(test, 0, s_pos);
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM - 1, q_pos);
+    scull_locate(&t->dev, SCULL_TEST_QUANTUM, &item, &s_pos, &q_pos);
+    KUNIT_EXPECT_EQ(test, 1, s_pos);
+    KUNIT_EXPECT_EQ(test, 0, q_pos);
+
+    /* last byte of a qset, first of the next */
+    scull_locate(&t->dev, SCULL_TEST_ITEM - 1, &item, &s_pos, &q_pos);
+    KUNIT_EXPECT_EQ(test, 0, item);
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QSET - 1, s_pos);
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM - 1, q_pos);
+    scull_locate(&t->dev, SCULL_TEST_ITEM, &item, &s_pos, &q_pos);
+    KUNIT_EXPECT_EQ(test, 1, item);
+    KUNIT_EXPECT_EQ(test, 0, s_pos);
+    KUNIT_EXPECT_EQ(test, 0, q_pos);
+
+    /* the last item scull_follow() can reach, and one past it */
+    KUNIT_EXPECT_EQ(test, 0, scull_locate(&t->dev,
+                    (loff_t)INT_MAX * SCULL_TEST_ITEM + SCULL_TEST_ITEM - 1,
+                    &item, &s_pos, &q_pos));
+    KUNIT_EXPECT_EQ(test, INT_MAX, item);
+    KUNIT_EXPECT_EQ(test, -EFBIG, scull_locate(&t->dev,
+                    (loff_t)INT_MAX * SCULL_TEST_ITEM + SCULL_TEST_ITEM,
+                    &item, &s_pos, &q_pos));
+    KUNIT_EXPECT_EQ(test, -EFBIG, scull_locate(&t->dev, LLONG_MAX,
+                    &item, &s_pos, &q_pos));
+    KUNIT_EXPECT_EQ(test, -EFBIG, scull_locate(&t->dev, -1,
+                    &item, &s_pos, &q_pos));
+
+    /* an item size that overflows an int */
+    t->dev.quantum = 1 << 20;
+    t->dev.qset = 1 << 12;
+    KUNIT_EXPECT_EQ(test, 0, scull_locate(&t->dev, (1LL << 32) + 5,
+                    &item, &s_pos, &q_pos));
+    KUNIT_EXPECT_EQ(test, 1, item);
+    KUNIT_EXPECT_EQ(test, 0, s_pos);
+    KUNIT_EXPECT_EQ(test, 5, q_pos);
+    t->dev.quantum = SCULL_TEST_QUANTUM;
+    t->dev.qset = SCULL_TEST_QSET;
+}
+
+static void scull_test_follow(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    struct scull_qset *qs;
+
+    /* lookups never allocate */
+    KUNIT_EXPECT_PTR_EQ(test, scull_lookup(&t->dev, 0), NULL);
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, NULL);
+
+    qs = scull_follow(&t->dev, 3);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, qs);
+    KUNIT_EXPECT_EQ(test, 4, scull_test_nodes(&t->dev));
+    KUNIT_EXPECT_PTR_EQ(test, qs->data, NULL);
+
+    /* a second walk finds the same nodes */
+    KUNIT_EXPECT_PTR_EQ(test, qs, scull_follow(&t->dev, 3));
+    KUNIT_EXPECT_PTR_EQ(test, qs, scull_lookup(&t->dev, 3));
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, scull_follow(&t->dev, 0));
+    KUNIT_EXPECT_EQ(test, 4, scull_test_nodes(&t->dev));
+
+    KUNIT_EXPECT_PTR_EQ(test, scull_lookup(&t->dev, 4), NULL);
+    KUNIT_EXPECT_EQ(test, 4, scull_test_nodes(&t->dev));
+}
+
+static void scull_test_quantum_edge(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    char in[] = "abcdefgh", out[16];
+    loff_t pos = SCULL_TEST_QUANTUM - 2;
+
+    /* a write stops at the end of the quantum */
+    KUNIT_EXPECT_EQ(test, 2, scull_test_io(t, true, in, 8, &pos));
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM, pos);
+    KUNIT_EXPECT_EQ(test, 6, scull_test_io(t, true, in + 2, 6, &pos));
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM + 6, pos);
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM + 6, t->dev.size);
+
+    /* and so does a read */
+    pos = SCULL_TEST_QUANTUM - 2;
+    KUNIT_EXPECT_EQ(test, 2, scull_test_io(t, false, out, sizeof(out), &pos));
+    KUNIT_EXPECT_EQ(test, 0, memcmp(out, "ab", 2));
+    KUNIT_EXPECT_EQ(test, 6, scull_test_io(t, false, out, sizeof(out), &pos));
+    KUNIT_EXPECT_EQ(test, 0, memcmp(out, "cdefgh", 6));
+
+    /* at the end of the data */
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, out, sizeof(out), &pos));
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM + 6, pos);
+
+    /* empty transfers are not faults */
+    pos = 0;
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, out, 0, &pos));
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, true, in, 0, &pos));
+    KUNIT_EXPECT_EQ(test, SCULL_TEST_QUANTUM + 6, t->dev.size);
+}
+
+static void scull_test_qset_edge(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    char in[] = "wxyz", out[4];
+    loff_t pos = SCULL_TEST_ITEM - 2;
+
+    KUNIT_EXPECT_EQ(test, 2, scull_test_io(t, true, in, 4, &pos));
+    KUNIT_EXPECT_EQ(test, 1, scull_test_nodes(&t->dev));
+    KUNIT_EXPECT_EQ(test, 2, scull_test_io(t, true, in + 2, 2, &pos));
+    KUNIT_EXPECT_EQ(test, 2, scull_test_nodes(&t->dev));
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->dev.data->next->data);
+    KUNIT_EXPECT_NOT_ERR_OR_NULL(test, t->dev.data->next->data[0]);
+
+    pos = SCULL_TEST_ITEM - 2;
+    KUNIT_EXPECT_EQ(test, 2, scull_test_io(t, false, out, 4, &pos));
+    KUNIT_EXPECT_EQ(test, 2, scull_test_io(t, false, out + 2, 2, &pos));
+    KUNIT_EXPECT_EQ(test, 0, memcmp(out, in, 4));
+}
+
+static void scull_test_hole(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    char c = 'x', out[4];
+    loff_t pos;
+
+    /* one byte in the second quantum of item 3; the rest is holes */
+    pos = 3 * SCULL_TEST_ITEM + SCULL_TEST_QUANTUM + 4;
+    KUNIT_EXPECT_EQ(test, 1, scull_test_io(t, true, &c, 1, &pos));
+    KUNIT_EXPECT_EQ(test, 3 * SCULL_TEST_ITEM + SCULL_TEST_QUANTUM + 5, t->dev.size);
+    KUNIT_EXPECT_EQ(test, 4, scull_test_nodes(&t->dev));
+
+    /* holes read as end of data, and reading them allocates nothing */
+    pos = 0;
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, out, 4, &pos));
+    KUNIT_EXPECT_EQ(test, 0, pos);
+    pos = SCULL_TEST_ITEM + 3;
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, out, 4, &pos));
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data->next->data, NULL);
+
+    /* a missing quantum in a populated qset is a hole too */
+    pos = 3 * SCULL_TEST_ITEM + 4;
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, out, 4, &pos));
+    KUNIT_EXPECT_PTR_EQ(test, scull_lookup(&t->dev, 3)->data[0], NULL);
+
+    pos = 3 * SCULL_TEST_ITEM + SCULL_TEST_QUANTUM + 4;
+    KUNIT_EXPECT_EQ(test, 1, scull_test_io(t, false, out, 4, &pos));
+    KUNIT_EXPECT_EQ(test, 'x', out[0]);
+    KUNIT_EXPECT_EQ(test, 4, scull_test_nodes(&t->dev));
+}
+
+static void scull_test_huge_offset(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    char c = 'x';
+    loff_t pos;
+
+    /* past the last reachable item: refused before anything is allocated */
+    pos = (loff_t)INT_MAX * SCULL_TEST_ITEM + SCULL_TEST_ITEM;
+    KUNIT_EXPECT_EQ(test, -EFBIG, scull_test_io(t, true, &c, 1, &pos));
+    pos = LLONG_MAX;
+    KUNIT_EXPECT_EQ(test, -EFBIG, scull_test_io(t, true, &c, 1, &pos));
+    KUNIT_EXPECT_EQ(test, LLONG_MAX, pos);
+    pos = -1;
+    KUNIT_EXPECT_EQ(test, -EFBIG, scull_test_io(t, true, &c, 1, &pos));
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, NULL);
+    KUNIT_EXPECT_EQ(test, 0, t->dev.size);
+
+    /* reads there are at end of data */
+    pos = LLONG_MAX;
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, &c, 1, &pos));
+    pos = -1;
+    KUNIT_EXPECT_EQ(test, 0, scull_test_io(t, false, &c, 1, &pos));
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, NULL);
+}
+
+static void scull_test_trim(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    char buf[SCULL_TEST_ITEM + 4];
+    loff_t pos = 0;
+
+    memset(buf, 'a', sizeof(buf));
+    while (pos < (loff_t)sizeof(buf))
+        KUNIT_ASSERT_GT(test, scull_test_io(t, true, buf + pos,
+                                            sizeof(buf) - pos, &pos), 0);
+    KUNIT_EXPECT_EQ(test, 2, scull_test_nodes(&t->dev));
+
+    KUNIT_EXPECT_EQ(test, 0, scull_trim(&t->dev));
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, NULL);
+    KUNIT_EXPECT_EQ(test, 0, t->dev.size);
+
+    /* trimming an empty device is fine */
+    KUNIT_EXPECT_EQ(test, 0, scull_trim(&t->dev));
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, NULL);
+}
+
+static void scull_test_llseek(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    struct file *filp = &t->filp;
+
+    t->dev.size = 100;
+    KUNIT_EXPECT_EQ(test, 10, scull_llseek(filp, 10, SEEK_SET));
+    KUNIT_EXPECT_EQ(test, 15, scull_llseek(filp, 5, SEEK_CUR));
+    KUNIT_EXPECT_EQ(test, 90, scull_llseek(filp, -10, SEEK_END));
+    KUNIT_EXPECT_EQ(test, 200, scull_llseek(filp, 100, SEEK_END));
+    KUNIT_EXPECT_EQ(test, 200, filp->f_pos);
+
+    /* failures leave the position alone */
+    KUNIT_EXPECT_EQ(test, -EINVAL, scull_llseek(filp, -1, SEEK_SET));
+    KUNIT_EXPECT_EQ(test, -EINVAL, scull_llseek(filp, -201, SEEK_CUR));
+    KUNIT_EXPECT_EQ(test, -EINVAL, scull_llseek(filp, LLONG_MAX, SEEK_CUR));
+    KUNIT_EXPECT_EQ(test, -EINVAL, scull_llseek(filp, LLONG_MAX, SEEK_END));
+    KUNIT_EXPECT_EQ(test, -EINVAL, scull_llseek(filp, 0, 42));
+    KUNIT_EXPECT_EQ(test, 200, filp->f_pos);
+    t->dev.size = 0;
+}
+
+/*
+ * Benchmarks. They check little and report ns/node, MB/s and
+ * ns/quantum so that changes to the list and allocation code can be
+ * compared run to run on the same machine.
+ */
+static void scull_bench_follow(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    u64 start, follow, lookup;
+    int i;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, scull_follow(&t->dev, SCULL_BENCH_DEPTH - 1));
+
+    start = ktime_get_ns();
+    for (i = 0; i < SCULL_BENCH_WALKS; i++)
+        scull_follow(&t->dev, SCULL_BENCH_DEPTH - 1);
+    follow = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < SCULL_BENCH_WALKS; i++)
+        scull_lookup(&t->dev, SCULL_BENCH_DEPTH - 1);
+    lookup = ktime_get_ns() - start;
+
+    KUNIT_EXPECT_EQ(test, SCULL_BENCH_DEPTH, scull_test_nodes(&t->dev));
+    kunit_info(test, "depth %d: follow %llu ns/node, lookup %llu ns/node\n",
+               SCULL_BENCH_DEPTH,
+               div64_u64(follow, (u64)SCULL_BENCH_WALKS * SCULL_BENCH_DEPTH),
+               div64_u64(lookup, (u64)SCULL_BENCH_WALKS * SCULL_BENCH_DEPTH));
+}
+
+/* write SCULL_BENCH_FILL bytes with the default geometry, in quanta */
+static u64 scull_bench_fill_dev(struct kunit *test, struct scull_test *t)
+{
+    void *buf;
+    loff_t pos = 0;
+    ssize_t ret;
+    u64 start;
+
+    t->dev.quantum = SCULL_QUANTUM;
+    t->dev.qset = SCULL_QSET;
+    buf = kunit_kzalloc(test, SCULL_QUANTUM, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+    start = ktime_get_ns();
+    while (pos < SCULL_BENCH_FILL) {
+        ret = scull_test_io(t, true, buf, SCULL_QUANTUM, &pos);
+        KUNIT_ASSERT_GT(test, ret, 0);
+    }
+    return ktime_get_ns() - start;
+}
+
+static void scull_bench_fill(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    u64 ns = scull_bench_fill_dev(test, t);
+
+    KUNIT_EXPECT_GE(test, t->dev.size, (unsigned long)SCULL_BENCH_FILL);
+    kunit_info(test, "%d bytes in %llu ns: %llu MB/s\n", SCULL_BENCH_FILL, ns,
+               div64_u64((u64)SCULL_BENCH_FILL * 1000, ns ?: 1));
+}
+
+static void scull_bench_trim(struct kunit *test)
+{
+    struct scull_test *t = test->priv;
+    u64 start, ns, quanta;
+
+    scull_bench_fill_dev(test, t);
+    quanta = DIV_ROUND_UP(t->dev.size, SCULL_QUANTUM);
+
+    start = ktime_get_ns();
+    scull_trim(&t->dev);
+    ns = ktime_get_ns() - start;
+
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.data, NULL);
+    kunit_info(test, "%llu quanta in %llu ns: %llu ns/quantum\n",
+               quanta, ns, div64_u64(ns, quanta));
+}
+
+static struct kunit_case scull_test_cases[] = {
+    KUNIT_CASE(scull_test_locate),
+    KUNIT_CASE(scull_test_follow),
+    KUNIT_CASE(scull_test_quantum_edge),
+    KUNIT_CASE(scull_test_qset_edge),
+    KUNIT_CASE(scull_test_hole),
+    KUNIT_CASE(scull_test_huge_offset),
+    KUNIT_CASE(scull_test_trim),
+    KUNIT_CASE(scull_test_llseek),
+    KUNIT_CASE(scull_bench_follow),
+    KUNIT_CASE(scull_bench_fill),
+    KUNIT_CASE(scull_bench_trim),
+    {}
+};
+
+static struct kunit_suite scull_test_suite = {
+    .name = "scull",
+    .init = scull_test_init,
+    .exit = scull_test_exit,
+    .test_cases = scull_test_cases,
+};
+kunit_test_suite(scull_test_suite);
+
+MODULE_LICENSE("GPL");
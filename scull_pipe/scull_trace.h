@@ -0,0 +1,173 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Static tracepoints for the scull hot paths. They cost a patched-out
+ * branch when disabled, so they stay in production builds; see
+ * scull_lat.bt for a ready-made consumer.
+ */
+
+DECLARE_EVENT_CLASS(scull_io_enter,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+
+    TP_ARGS(minor, pos, count),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+    ),
+
+    TP_printk("minor=%u pos=%lld count=%zu",
+              __entry->minor, __entry->pos, __entry->count)
+);
+
+DEFINE_EVENT(scull_io_enter, scull_read_enter,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+    TP_ARGS(minor, pos, count));
+
+DEFINE_EVENT(scull_io_enter, scull_write_enter,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+    TP_ARGS(minor, pos, count));
+
+DEFINE_EVENT(scull_io_enter, scull_p_read_enter,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+    TP_ARGS(minor, pos, count));
+
+DEFINE_EVENT(scull_io_enter, scull_p_write_enter,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+    TP_ARGS(minor, pos, count));
+
+DECLARE_EVENT_CLASS(scull_io_exit,
+
+    TP_PROTO(unsigned int minor, ssize_t ret),
+
+    TP_ARGS(minor, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u ret=%zd", __entry->minor, __entry->ret)
+);
+
+DEFINE_EVENT(scull_io_exit, scull_read_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret),
+    TP_ARGS(minor, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_write_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret),
+    TP_ARGS(minor, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_p_read_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret),
+    TP_ARGS(minor, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_p_write_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret),
+    TP_ARGS(minor, ret));
+
+/* How many qset nodes scull_follow() had to walk */
+TRACE_EVENT(scull_follow,
+
+    TP_PROTO(unsigned int minor, int depth),
+
+    TP_ARGS(minor, depth),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, depth)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->depth = depth;
+    ),
+
+    TP_printk("minor=%u depth=%d", __entry->minor, __entry->depth)
+);
+
+#define SCULL_ALLOC_QSET    0   /* a struct scull_qset list node */
+#define SCULL_ALLOC_PTRS    1   /* the quantum pointer array of a node */
+#define SCULL_ALLOC_QUANTUM 2   /* a quantum */
+
+TRACE_EVENT(scull_alloc,
+
+    TP_PROTO(unsigned int minor, int kind, size_t size, const void *ptr),
+
+    TP_ARGS(minor, kind, size, ptr),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, kind)
+        __field(size_t, size)
+        __field(const void *, ptr)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->kind = kind;
+        __entry->size = size;
+        __entry->ptr = ptr;
+    ),
+
+    TP_printk("minor=%u kind=%s size=%zu ptr=%p", __entry->minor,
+              __print_symbolic(__entry->kind,
+                               { SCULL_ALLOC_QSET, "qset" },
+                               { SCULL_ALLOC_PTRS, "ptrs" },
+                               { SCULL_ALLOC_QUANTUM, "quantum" }),
+              __entry->size, __entry->ptr)
+);
+
+/* Time spent waiting for a device mutex, reported by the caller's ip */
+TRACE_EVENT(scull_lock_wait,
+
+    TP_PROTO(const void *lock, unsigned long ip, u64 wait_ns, int ret),
+
+    TP_ARGS(lock, ip, wait_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(const void *, lock)
+        __field(unsigned long, ip)
+        __field(u64, wait_ns)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->lock = lock;
+        __entry->ip = ip;
+        __entry->wait_ns = wait_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("lock=%p caller=%pS wait_ns=%llu ret=%d", __entry->lock,
+              (void *)__entry->ip, __entry->wait_ns, __entry->ret)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
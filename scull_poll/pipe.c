@@ -125,7 +125,7 @@ static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, l
     mutex_unlock(&dev->mutex);
 
  
-    wake_up_interruptible(&dev->outq);
+    wake_up_interruptible_poll(&dev->outq, POLLOUT | POLLWRNORM);
     PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
     return count;
 }
@@ -190,7 +190,7 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
     mutex_unlock(&dev->mutex);
 
   
-    wake_up_interruptible(&dev->inq);  
+    wake_up_interruptible_poll(&dev->inq, POLLIN | POLLRDNORM);  
 
 
     if (dev->async_queue)
@@ -200,19 +200,27 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 }
 
 
+/*
+ * Poll does not take the mutex: it only needs a snapshot of the two
+ * pointers, and a stale one is corrected by the wakeup that follows
+ * every read or write. The barrier orders the waitqueue insertion
+ * before the snapshot, so that wakeup cannot be missed.
+ */
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
     struct scull_pipe *dev = filp->private_data;
     unsigned int mask = 0;
+    char *rp, *wp;
 
-    mutex_lock_interruptible(&dev->mutex);
     poll_wait(filp, &dev->inq, wait);
     poll_wait(filp, &dev->outq, wait);
-    if (dev->rp != dev->wp)
+    smp_mb();
+    rp = READ_ONCE(dev->rp);
+    wp = READ_ONCE(dev->wp);
+    if (rp != wp)
         mask |= POLLIN | POLLRDNORM;
-    if (spacefree(dev))
+    if (rp == wp || ((rp + dev->buffersize - wp) % dev->buffersize) > 1)
         mask |= POLLOUT | POLLWRNORM;
-    mutex_unlock(&dev->mutex);
     return mask;
 }
 